@@ -0,0 +1,85 @@
+#include "../libFFT/AllignedBufferF.h"
+#include "../libFFT/AllignedBufferI16C.h"
+#include "../libFFT/FFTCpu.h"
+#include "../libFFT/FFTPointCount.h"
+#include "../libFFT/WindowFunction.h"
+
+#include <cmath>
+#include <cstdio>
+#include <random>
+
+
+#ifdef _DEBUG
+#pragma comment( lib , "../3rdparties/debug/lib/fftw3f")
+#pragma comment( lib , "../3rdparties/debug/lib/fftw3f_threads")
+#else
+#pragma comment( lib , "../3rdparties/lib/fftw3f")
+#pragma comment( lib , "../3rdparties/lib/fftw3f_threads")
+#endif
+
+// forwardBatch() against one forward() per frame. Returns the number of bins off by more than tolerance_db.
+static auto checkBatch(FFTPointCount fftp, int threads, size_t frames) ->size_t
+{
+	const size_t fft_point = size_t(fftp);
+	const float tolerance_db = 1e-3f;
+
+	FFTCpu cpu(fftp, WindowFunction::win_type::WIN_BLACKMAN_HARRIS, FFTCpu::PLAN_ESTIMATE, threads);
+
+	// A few trailing samples short of a frame, forwardBatch() has to ignore them
+	std::minstd_rand gen(12345);
+	std::uniform_int_distribution<int> dis(-16000, 16000);
+	auto batch = std::make_shared<AllignedBufferI16C>(frames * fft_point + 7);
+	for (size_t index = 0; index < batch->size(); ++index)
+	{
+		batch->set(index, std::complex<int16_t>(int16_t(dis(gen)), int16_t(dis(gen))));
+	}
+
+	auto ret_batch = cpu.forwardBatch(batch);
+	if (!ret_batch || ret_batch->size() != frames * fft_point)
+	{
+		printf("FFTCpu::forwardBatch %zu points, %d threads: %zu values instead of %zu\n", fft_point, threads, ret_batch ? ret_batch->size() : 0, frames * fft_point);
+		return 1;
+	}
+
+	size_t failures = 0;
+	auto frame = std::make_shared<AllignedBufferI16C>(fft_point);
+	for (size_t f = 0; f < frames; ++f)
+	{
+		for (size_t index = 0; index < fft_point; ++index)
+		{
+			frame->set(index, batch->get(f * fft_point + index));
+		}
+
+		auto ret_frame = cpu.forward(frame);
+		for (size_t bin = 0; bin < fft_point; ++bin)
+		{
+			const float diff = std::abs(ret_batch->get(f * fft_point + bin) - ret_frame->get(bin));
+			if (diff > tolerance_db && failures++ < 10)
+			{
+				printf("%zu points, %d threads, frame %zu, bin %zu : %f - %f = %f\n", fft_point, threads, f, bin, ret_batch->get(f * fft_point + bin), ret_frame->get(bin), diff);
+			}
+		}
+	}
+
+	printf("FFTCpu::forwardBatch %zu points, %d threads, %zu frames: %s\n", fft_point, threads, frames, failures == 0 ? "ok" : "FAILED");
+	return failures;
+}
+
+int main()
+{
+	size_t failures = 0;
+
+	// Several groups of kBatchPoints with a short last one, on one thread and on the per-thread buffers
+	const size_t group = size_t(FFTCpu::kBatchPoints) / size_t(FFTPointCount::Point_02K);
+	failures += checkBatch(FFTPointCount::Point_02K, 1, 3 * group + 5);
+	failures += checkBatch(FFTPointCount::Point_02K, 4, 3 * group + 5);
+
+	// A frame per group, and an odd number of frames over the threads
+	failures += checkBatch(FFTPointCount::Point_64K, 4, 7);
+
+	// A 3 * 2^n size on a thread count that does not divide the groups
+	const size_t group_03k = size_t(FFTCpu::kBatchPoints) / size_t(FFTPointCount::Point_03K);
+	failures += checkBatch(FFTPointCount::Point_03K, 3, 4 * group_03k + 1);
+
+	return failures == 0 ? 0 : 1;
+}
@@ -16,11 +16,13 @@
 #pragma comment( lib , "../3rdparties/debug/lib/OpenCL")
 //#pragma comment( lib , "../3rdparties/debug/lib/fmtd")
 #pragma comment( lib , "../3rdparties/debug/lib/fftw3f")
+#pragma comment( lib , "../3rdparties/debug/lib/fftw3f_threads")
 #else
 #pragma comment( lib , "../3rdparties/lib/clFFT")
 #pragma comment( lib , "../3rdparties/lib/OpenCL")
 //#pragma comment( lib , "../3rdparties/lib/fmt")
 #pragma comment( lib , "../3rdparties/lib/fftw3f")
+#pragma comment( lib , "../3rdparties/lib/fftw3f_threads")
 #endif
 
 int main()
@@ -12,8 +12,21 @@ AllignedBufferF::AllignedBufferF(const size_t sample_count)
 
 }
 
+AllignedBufferF::AllignedBufferF(const size_t sample_count, float* external, std::function<void()> release)
+	: buffer_(external)
+	, sample_count_(sample_count)
+	, release_(std::move(release))
+{
+}
+
 AllignedBufferF::~AllignedBufferF()
 {
+	if (release_)
+	{
+		release_();
+		return;
+	}
+
 	fftwf_free(buffer_);
 }
 
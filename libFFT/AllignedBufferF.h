@@ -1,4 +1,5 @@
 #pragma once
+#include <functional>
 #include <memory>
 
 class AllignedBufferF
@@ -7,6 +8,13 @@ class AllignedBufferF
 	friend class FFTOpenCL;
 public:
 	AllignedBufferF(const size_t sample_count);
+
+	/*!
+	 * \brief Wrap storage owned by someone else, e.g. mapped OpenCL memory.
+	 *
+	 * release is called from the destructor instead of freeing external.
+	 */
+	AllignedBufferF(const size_t sample_count, float* external, std::function<void()> release);
 	~AllignedBufferF();
 
 	[[nodiscard]]
@@ -19,4 +27,5 @@ private:
 
 	float* buffer_{ nullptr };
 	const size_t sample_count_;
+	std::function<void()> release_;
 };
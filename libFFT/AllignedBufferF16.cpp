@@ -0,0 +1,125 @@
+#include "AllignedBufferF16.h"
+
+#include <fftw3.h>
+
+#include <assert.h>
+#include <cstring>
+
+AllignedBufferF16::AllignedBufferF16(const size_t sample_count)
+	: sample_count_(sample_count)
+{
+	buffer_ = (uint16_t*)fftwf_malloc(sizeof(uint16_t) * sample_count);
+
+}
+
+AllignedBufferF16::~AllignedBufferF16()
+{
+	fftwf_free(buffer_);
+}
+
+uint16_t AllignedBufferF16::fromFloat(float value)
+{
+	uint32_t bits;
+	std::memcpy(&bits, &value, sizeof(bits));
+
+	const uint16_t sign = uint16_t((bits >> 16) & 0x8000);
+	const uint32_t exponent = (bits >> 23) & 0xff;
+	uint32_t mantissa = bits & 0x7fffff;
+
+	// NaN keeps a mantissa bit, infinity and overflow end up as infinity
+	if (exponent == 0xff)
+	{
+		return uint16_t(sign | 0x7c00 | (mantissa != 0 ? 0x200 : 0));
+	}
+
+	const int half_exponent = int(exponent) - 127 + 15;
+	if (half_exponent >= 0x1f)
+	{
+		return uint16_t(sign | 0x7c00);
+	}
+
+	if (half_exponent <= 0)
+	{
+		// Subnormal half, or zero below half of the smallest one
+		if (half_exponent < -10)
+		{
+			return sign;
+		}
+		mantissa |= 0x800000;
+		const int shift = 14 - half_exponent;
+		uint32_t half_mantissa = mantissa >> shift;
+		const uint32_t rest = mantissa & ((1u << shift) - 1);
+		const uint32_t halfway = 1u << (shift - 1);
+		if (rest > halfway || (rest == halfway && (half_mantissa & 1)))
+		{
+			++half_mantissa;
+		}
+		return uint16_t(sign | half_mantissa);
+	}
+
+	uint32_t half = (uint32_t(half_exponent) << 10) | (mantissa >> 13);
+	const uint32_t rest = mantissa & 0x1fff;
+	if (rest > 0x1000 || (rest == 0x1000 && (half & 1)))
+	{
+		// A carry into the exponent is the correct rounding, up to infinity
+		++half;
+	}
+	return uint16_t(sign | half);
+}
+
+float AllignedBufferF16::toFloat(uint16_t half)
+{
+	const uint32_t sign = uint32_t(half & 0x8000) << 16;
+	uint32_t exponent = (half >> 10) & 0x1f;
+	uint32_t mantissa = half & 0x3ff;
+
+	uint32_t bits;
+	if (exponent == 0x1f)
+	{
+		bits = sign | 0x7f800000 | (mantissa << 13);
+	}
+	else if (exponent != 0)
+	{
+		bits = sign | ((exponent + 127 - 15) << 23) | (mantissa << 13);
+	}
+	else if (mantissa == 0)
+	{
+		bits = sign;
+	}
+	else
+	{
+		// Subnormal half, normalise it
+		exponent = 127 - 15 + 1;
+		while ((mantissa & 0x400) == 0)
+		{
+			mantissa <<= 1;
+			--exponent;
+		}
+		bits = sign | (exponent << 23) | ((mantissa & 0x3ff) << 13);
+	}
+
+	float value;
+	std::memcpy(&value, &bits, sizeof(value));
+	return value;
+}
+
+[[nodiscard]] 
+float AllignedBufferF16::get(const size_t pos)const
+{ 
+	// subscript mutable sequence
+#if _DEBUG
+	assert(pos < sample_count_ && "vector subscript out of range");
+#endif
+
+	return toFloat(buffer_[pos]);
+}
+
+void AllignedBufferF16::set(const size_t pos, float data)
+{
+	// subscript mutable sequence
+#if _DEBUG
+	assert(pos < sample_count_ && "vector subscript out of range");
+#endif
+
+	buffer_[pos] = fromFloat(data);
+}
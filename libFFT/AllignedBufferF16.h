@@ -0,0 +1,31 @@
+#pragma once
+#include <cstdint>
+
+/*!
+ * \brief Samples stored as IEEE 754 half floats, e.g. a dB spectrum at half the
+ * size of AllignedBufferF.
+ *
+ * The layout matches cl_half and vstore_half(), so device output can be
+ * downloaded straight into data(). get() and set() convert to and from float.
+ */
+class AllignedBufferF16
+{
+public:
+	AllignedBufferF16(const size_t sample_count);
+	~AllignedBufferF16();
+
+	[[nodiscard]]
+	float get(const size_t pos)const;
+	void set(const size_t pos, float data);
+	size_t size() const { return sample_count_; }
+	uint16_t* data() { return buffer_; }
+
+	//! Round to nearest even, out of range values become infinities.
+	static uint16_t fromFloat(float value);
+	static float toFloat(uint16_t half);
+
+private:
+
+	uint16_t* buffer_{ nullptr };
+	const size_t sample_count_;
+};
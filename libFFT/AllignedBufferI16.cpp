@@ -0,0 +1,38 @@
+#include "AllignedBufferI16.h"
+
+#include <fftw3.h>
+
+#include <assert.h>
+
+AllignedBufferI16::AllignedBufferI16(const size_t sample_count)
+	: sample_count_(sample_count)
+{
+	buffer_ = (int16_t*)fftwf_malloc(sizeof(int16_t) * sample_count);
+
+}
+
+AllignedBufferI16::~AllignedBufferI16()
+{
+	fftwf_free(buffer_);
+}
+
+[[nodiscard]] 
+int16_t AllignedBufferI16::get(const size_t pos)const
+{ 
+	// subscript mutable sequence
+#if _DEBUG
+	assert(pos < sample_count_ && "vector subscript out of range");
+#endif
+
+	return buffer_[pos];
+}
+
+void AllignedBufferI16::set(const size_t pos, int16_t data)
+{
+	// subscript mutable sequence
+#if _DEBUG
+	assert(pos < sample_count_ && "vector subscript out of range");
+#endif
+
+	buffer_[pos] = data;
+}
@@ -0,0 +1,23 @@
+#pragma once
+#include <cstdint>
+
+/*!
+ * \brief Real int16 samples, e.g. a dB spectrum quantised to centi-dB.
+ */
+class AllignedBufferI16
+{
+public:
+	AllignedBufferI16(const size_t sample_count);
+	~AllignedBufferI16();
+
+	[[nodiscard]]
+	int16_t get(const size_t pos)const;
+	void set(const size_t pos, int16_t data);
+	size_t size() const { return sample_count_; }
+	int16_t* data() { return buffer_; }
+
+private:
+
+	int16_t* buffer_{ nullptr };
+	const size_t sample_count_;
+};
@@ -12,8 +12,22 @@ AllignedBufferI16C::AllignedBufferI16C(size_t sample_count)
 }
 
 
+AllignedBufferI16C::AllignedBufferI16C(size_t sample_count, std::complex<int16_t>* external, std::function<void()> release)
+	:buffer_(external)
+	,sample_count_(sample_count)
+	,release_(std::move(release))
+{
+}
+
+
 AllignedBufferI16C::~AllignedBufferI16C()
 {
+	if (release_)
+	{
+		release_();
+		return;
+	}
+
 	fftwf_free(buffer_);
 }
 
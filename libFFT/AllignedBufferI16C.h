@@ -1,12 +1,20 @@
 #pragma once
 #include <cstdint>
 #include <complex>
+#include <functional>
 
 class AllignedBufferI16C
 {
 	friend class FFTCpu;
 public:
 	AllignedBufferI16C(size_t sample_count);
+
+	/*!
+	 * \brief Wrap storage owned by someone else, e.g. mapped OpenCL memory.
+	 *
+	 * release is called from the destructor instead of freeing external.
+	 */
+	AllignedBufferI16C(size_t sample_count, std::complex<int16_t>* external, std::function<void()> release);
 	~AllignedBufferI16C();
 
 	[[nodiscard]]
@@ -19,4 +27,5 @@ private:
 
 	std::complex<int16_t>* buffer_{ nullptr };
 	const size_t sample_count_{ 0 };
+	std::function<void()> release_;
 };
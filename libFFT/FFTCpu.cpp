@@ -2,30 +2,151 @@
 
 #include "AllignedBufferF.h"
 #include "AllignedBufferI16C.h"
+#include "FFTWisdom.h"
+#include "SimdKernels.h"
 #include "WindowFunction.h"
 
 #include <fftw3.h>
 
+#include <algorithm>
 #include <assert.h>
 #include <omp.h>
 
-FFTCpu::FFTCpu(const FFTPointCount fft_point, const WindowFunction::win_type win_type)
+// Runs fn(begin, count) on count values split into one run per thread. Runs start on
+// multiples of 16 values, so every thread but the last stays on whole SIMD vectors.
+template <typename Fn>
+static void parallelRuns(int threads, size_t count, Fn fn)
+{
+	if (threads <= 1)
+	{
+		fn(size_t(0), count);
+		return;
+	}
+
+	const size_t run = (count / size_t(threads) + 15) / 16 * 16;
+
+#pragma omp parallel for num_threads(threads)
+	for (int thread = 0; thread < threads; ++thread)
+	{
+		const size_t begin = std::min(count, size_t(thread) * run);
+		const size_t end = thread + 1 == threads ? count : std::min(count, begin + run);
+		if (end > begin)
+		{
+			fn(begin, end - begin);
+		}
+	}
+}
+
+static bool initThreads()
+{
+	static const bool threads_ready = fftwf_init_threads() != 0;
+	return threads_ready;
+}
+
+FFTCpu::FFTCpu(const FFTPointCount fft_point, const WindowFunction::win_type win_type, const planner_effort effort, const int threads)
 	: fft_point_(fft_point)
+	, effort_(effort)
 {
+	// fftwf_init_threads() has to come before any other FFTW call of the instance, the allocations included
+	const bool threads_ready = initThreads();
+
+	batch_threads_ = threads > 0 ? threads : omp_get_max_threads();
+	if (int(fft_point) >= kMinThreadedPoints && threads_ready)
+	{
+		threads_ = batch_threads_;
+	}
+
 	window_vec_ = WindowFunction::build(win_type, int(fft_point),0);
 
+	window_pairs_.resize(2 * window_vec_.size());
+	for (size_t i = 0; i < window_vec_.size(); ++i)
+	{
+		window_pairs_[2 * i + 0] = window_vec_[i] / 32768.0f;
+		window_pairs_[2 * i + 1] = window_vec_[i] / 32768.0f;
+	}
+
 	in_ = (std::complex<float>*)fftwf_malloc(sizeof(fftwf_complex) * int(fft_point_));
 	out_ = (std::complex<float>*)fftwf_malloc(sizeof(fftwf_complex) * int(fft_point_));
 
-	handle_ = fftwf_plan_dft_1d(int(fft_point_), (fftwf_complex*)in_, (fftwf_complex*)out_, FFTW_FORWARD, FFTW_ESTIMATE);
+	handle_ = makePlan(1, in_, out_, threads_);
 }
 
 FFTCpu::~FFTCpu(void)
 {
 	fftwf_free(in_);
 	fftwf_free(out_);
+	for (size_t i = 0; i < batch_in_.size(); ++i)
+	{
+		fftwf_free(batch_in_[i]);
+		fftwf_free(batch_out_[i]);
+	}
+
+	std::lock_guard<std::recursive_mutex> lock(FFTWisdom::plannerMutex());
 	fftwf_destroy_plan(handle_);
 	handle_ = nullptr;
+	if (batch_handle_ != nullptr)
+	{
+		fftwf_destroy_plan(batch_handle_);
+		batch_handle_ = nullptr;
+	}
+}
+
+auto FFTCpu::makePlan(int frames, std::complex<float>* in, std::complex<float>* out, int threads) ->fftwf_plan
+{
+	std::lock_guard<std::recursive_mutex> lock(FFTWisdom::plannerMutex());
+
+	// The thread count is planner state, set for every plan while the planner is held
+	if (initThreads())
+	{
+		fftwf_plan_with_nthreads(threads);
+	}
+
+	int n = int(fft_point_);
+	auto plan = [&](unsigned flags)
+	{
+		return fftwf_plan_many_dft(1, &n, frames, (fftwf_complex*)in, nullptr, 1, n, (fftwf_complex*)out, nullptr, 1, n, FFTW_FORWARD, flags);
+	};
+
+	if (effort_ == PLAN_ESTIMATE)
+	{
+		return plan(FFTW_ESTIMATE);
+	}
+
+	const unsigned flags[] = { FFTW_ESTIMATE, FFTW_MEASURE, FFTW_PATIENT, FFTW_EXHAUSTIVE };
+	FFTWisdom::load();
+
+	// Only a plan that was not in the wisdom yet costs a measurement and a rewrite of the file
+	fftwf_plan handle = plan(flags[effort_] | FFTW_WISDOM_ONLY);
+	if (handle == nullptr)
+	{
+		handle = plan(flags[effort_]);
+		FFTWisdom::save();
+	}
+	return handle;
+}
+
+// 20 * log10(|X| / N) == 10 * log10(|X|^2 / N^2), fftshifted: output position i reads
+// bin (i + upper_pt) % fft_pt, so a run splits at most once at the wrap. An odd size has
+// one bin more in the upper half.
+void FFTCpu::shiftedDb(const std::complex<float>* bins, float* db, size_t begin, size_t count) const
+{
+	const size_t fft_pt = size_t(fft_point_);
+	const size_t half_fft_pt = fft_pt / 2;
+	const size_t upper_pt = fft_pt - half_fft_pt;
+	const float invpower = 1.0f / float(fft_point_);
+	const float scale = invpower * invpower;
+
+	const size_t end = begin + count;
+	if (begin < half_fft_pt)
+	{
+		const size_t lower_end = std::min(end, half_fft_pt);
+		simd::powerToDb((const float*)(bins + upper_pt + begin), db + begin, lower_end - begin, scale, db_precision_);
+		begin = lower_end;
+	}
+	if (begin < end)
+	{
+		simd::powerToDb((const float*)(bins + begin - half_fft_pt), db + begin, end - begin, scale, db_precision_);
+	}
 }
 
 auto FFTCpu::forward(std::shared_ptr<AllignedBufferI16C>& input_buffer) ->std::shared_ptr<AllignedBufferF>
@@ -58,15 +179,13 @@ auto FFTCpu::forward(std::shared_ptr<AllignedBufferI16C>& input_buffer) ->std::s
 
 	auto fffrrrssss = omp_get_wtime();
 	int fft_pt = int(fft_point_);
-	int half_fft_pt = fft_pt / 2;
 
-	for (int i = 0; i < input_buffer->sample_count_; ++i)
+	// int16 to float and the window in one pass over the interleaved re / im values
+	const int16_t* samples = (const int16_t*)input_buffer->buffer_;
+	parallelRuns(threads_, 2 * input_buffer->sample_count_, [&](size_t begin, size_t count)
 	{
-		auto sample = input_buffer->get(i);
-
-		in_[i].real(input_buffer->get(i + 0).real() * (window_vec_[i]) / 32768.0f);
-		in_[i].imag(input_buffer->get(i + 0).imag() * (window_vec_[i]) / 32768.0f);
-	}
+		simd::windowInt16(samples + begin, window_pairs_.data() + begin, (float*)in_ + begin, count);
+	});
 
 	fftwf_execute(handle_);
 
@@ -76,19 +195,62 @@ auto FFTCpu::forward(std::shared_ptr<AllignedBufferI16C>& input_buffer) ->std::s
 
 	std::shared_ptr<AllignedBufferF> out_buffer = std::make_shared<AllignedBufferF>(input_buffer->sample_count_);
 
-	float  invpower = 1.0f / float(fft_point_);
+	float* db = out_buffer->data();
+	parallelRuns(threads_, size_t(fft_pt), [&](size_t begin, size_t count)
+	{
+		shiftedDb(out_, db, begin, count);
+	});
 
-	for (int i = 0; i < half_fft_pt; i += 4)
+	return out_buffer;
+}
+
+auto FFTCpu::forwardBatch(std::shared_ptr<AllignedBufferI16C>& input_buffer) ->std::shared_ptr<AllignedBufferF>
+{
+	const size_t fft_pt = size_t(fft_point_);
+	const size_t frames = input_buffer->sample_count_ / fft_pt;
+
+	if (batch_handle_ == nullptr)
 	{
-		out_buffer->set(half_fft_pt + i + 0, 20 * std::log10f(std::abs(out_[i + 0] * invpower)));
-		out_buffer->set(half_fft_pt + i + 1, 20 * std::log10f(std::abs(out_[i + 1] * invpower)));
-		out_buffer->set(half_fft_pt + i + 2, 20 * std::log10f(std::abs(out_[i + 2] * invpower)));
-		out_buffer->set(half_fft_pt + i + 3, 20 * std::log10f(std::abs(out_[i + 3] * invpower)));
+		// Every thread runs its own group single-threaded on its own buffers; fftwf_execute_dft
+		// is thread-safe and fftwf_malloc keeps the alignment the plan was made for
+		batch_frames_ = std::max(1, kBatchPoints / int(fft_point_));
+		batch_in_.resize(size_t(batch_threads_));
+		batch_out_.resize(size_t(batch_threads_));
+		for (int i = 0; i < batch_threads_; ++i)
+		{
+			batch_in_[i] = (std::complex<float>*)fftwf_malloc(sizeof(fftwf_complex) * fft_pt * size_t(batch_frames_));
+			batch_out_[i] = (std::complex<float>*)fftwf_malloc(sizeof(fftwf_complex) * fft_pt * size_t(batch_frames_));
+		}
+		batch_handle_ = makePlan(batch_frames_, batch_in_[0], batch_out_[0], 1);
+	}
+
+	std::shared_ptr<AllignedBufferF> out_buffer = std::make_shared<AllignedBufferF>(frames * fft_pt);
+
+	const int16_t* samples = (const int16_t*)input_buffer->buffer_;
+	float* db = out_buffer->data();
+	const int groups = int((frames + size_t(batch_frames_) - 1) / size_t(batch_frames_));
+
+#pragma omp parallel for num_threads(batch_threads_) schedule(dynamic) if(groups > 1)
+	for (int group = 0; group < groups; ++group)
+	{
+		std::complex<float>* in = batch_in_[omp_get_thread_num()];
+		std::complex<float>* out = batch_out_[omp_get_thread_num()];
+
+		const size_t first = size_t(group) * size_t(batch_frames_);
+		const size_t count = std::min(size_t(batch_frames_), frames - first);
+
+		// A short last group transforms whatever the buffer still holds and discards it
+		for (size_t f = 0; f < count; ++f)
+		{
+			simd::windowInt16(samples + 2 * fft_pt * (first + f), window_pairs_.data(), (float*)(in + fft_pt * f), 2 * fft_pt);
+		}
+
+		fftwf_execute_dft(batch_handle_, (fftwf_complex*)in, (fftwf_complex*)out);
 
-		out_buffer->set(i + 0, 20 * std::log10f(std::abs(out_[half_fft_pt + i + 0] * invpower)));
-		out_buffer->set(i + 1, 20 * std::log10f(std::abs(out_[half_fft_pt + i + 1] * invpower)));
-		out_buffer->set(i + 2, 20 * std::log10f(std::abs(out_[half_fft_pt + i + 2] * invpower)));
-		out_buffer->set(i + 3, 20 * std::log10f(std::abs(out_[half_fft_pt + i + 3] * invpower)));
+		for (size_t f = 0; f < count; ++f)
+		{
+			shiftedDb(out + fft_pt * f, db + fft_pt * (first + f), 0, fft_pt);
+		}
 	}
 
 	return out_buffer;
@@ -1,9 +1,11 @@
 #pragma once
 
 #include "FFTpointCount.h"
+#include "SimdKernels.h"
 #include "WindowFunction.h"
 
 #include <complex>
+#include <memory>
 #include <vector>
 
 class AllignedBufferF;
@@ -16,15 +18,69 @@ typedef struct fftwf_plan_s* fftwf_plan;
 class FFTCpu
 {
 public:
-	FFTCpu(const FFTPointCount fft_point ,const WindowFunction::win_type win_type);
+	//! FFTW planner flag the plan is made with.
+	enum planner_effort {
+		PLAN_ESTIMATE = 0,   //!< heuristics only, no measurement and no wisdom
+		PLAN_MEASURE = 1,    //!< times a few candidate plans, seconds at 512K points
+		PLAN_PATIENT = 2,    //!< times many more, minutes at 512K points
+		PLAN_EXHAUSTIVE = 3, //!< times everything
+	};
+
+	/*!
+	 * \brief Plan a forward transform of fft_point samples.
+	 *
+	 * Above PLAN_ESTIMATE the plan comes from FFTWisdom when an earlier process
+	 * on this CPU model measured it; otherwise it is measured now and the wisdom
+	 * file is updated.
+	 *
+	 * threads is the thread count of the FFTW plan and of the OpenMP windowing
+	 * and dB loops, 0 for omp_get_max_threads(). Sizes below kMinThreadedPoints
+	 * always run on the calling thread, there the thread start-up costs more
+	 * than it saves.
+	 */
+	FFTCpu(const FFTPointCount fft_point ,const WindowFunction::win_type win_type, const planner_effort effort = PLAN_ESTIMATE, const int threads = 0);
 	~FFTCpu();
 
 	auto forward(std::shared_ptr<AllignedBufferI16C>& input_buffer) ->std::shared_ptr<AllignedBufferF>;
+
+	/*!
+	 * \brief forward() over every whole frame of input_buffer.
+	 *
+	 * input_buffer holds the frames back to back, the result holds their dB
+	 * spectra the same way, frame f at f * fft_point. Groups of kBatchPoints
+	 * samples go through one fftwf_plan_many_dft execution and the groups are
+	 * spread over the thread count given to the constructor, whatever the size.
+	 * Trailing samples short of a frame are ignored.
+	 */
+	auto forwardBatch(std::shared_ptr<AllignedBufferI16C>& input_buffer) ->std::shared_ptr<AllignedBufferF>;
+
+	static const int kMinThreadedPoints = 64 * 1024;
+	static const int kBatchPoints = 64 * 1024;
+
+	//! Threads forward() actually uses.
+	int threads() const { return threads_; }
+
+	//! dB conversion of forward(), see simd::powerToDb(). DB_FAST by default.
+	void setDbPrecision(simd::db_precision precision) { db_precision_ = precision; }
+	simd::db_precision dbPrecision() const { return db_precision_; }
 private:
+	auto makePlan(int frames, std::complex<float>* in, std::complex<float>* out, int threads) ->fftwf_plan;
+	void shiftedDb(const std::complex<float>* bins, float* db, size_t begin, size_t count) const;
 
 	fftwf_plan  handle_;
 	std::complex<float>* in_;
 	std::complex<float>* out_;
 	std::vector<float>	window_vec_;
+	std::vector<float>	window_pairs_; // window_vec_ / 32768 with every weight twice, for re and im
 	FFTPointCount fft_point_;
+	simd::db_precision db_precision_{ simd::DB_FAST };
+	int threads_{ 1 };
+	planner_effort effort_;
+
+	// forwardBatch() state, made on its first call
+	fftwf_plan batch_handle_{ nullptr };
+	int batch_frames_{ 0 };
+	int batch_threads_{ 1 };
+	std::vector<std::complex<float>*> batch_in_;  // one work buffer per thread
+	std::vector<std::complex<float>*> batch_out_;
 };
@@ -1,15 +1,56 @@
 #pragma once
 
+#include <cstddef>
+#include <initializer_list>
+
 enum class FFTPointCount
 {
 	Point_02K = 2 * 1024,
+	Point_03K = 3 * 1024,
 	Point_04K = 4 * 1024,
+	Point_05K = 5 * 1024,
+	Point_06K = 6 * 1024,
 	Point_08K = 8 * 1024,
+	Point_10K = 10 * 1024,
+	Point_12K = 12 * 1024,
 	Point_16K = 16 * 1024,
+	Point_20K = 20 * 1024,
+	Point_24K = 24 * 1024,
 	Point_32K = 32 * 1024,
+	Point_40K = 40 * 1024,
+	Point_48K = 48 * 1024,
 	Point_64K = 64 * 1024,
+	Point_80K = 80 * 1024,
+	Point_96K = 96 * 1024,
 	Point_128K = 128 * 1024,
+	Point_160K = 160 * 1024,
+	Point_192K = 192 * 1024,
 	Point_256K = 256 * 1024,
+	Point_320K = 320 * 1024,
+	Point_384K = 384 * 1024,
 	Point_512K = 512 * 1024,
 };
 
+/*!
+ * \brief True when sample_count factors into 2, 3, 5 and 7 only.
+ *
+ * Every such size works in FFTCpu and ModuleSignalProcessing, the named
+ * FFTPointCount values are just the common ones; cast any other to FFTPointCount.
+ */
+inline bool isSmoothPointCount(size_t sample_count)
+{
+	if (sample_count < 2)
+	{
+		return false;
+	}
+
+	for (size_t radix : { 2, 3, 5, 7 })
+	{
+		while (sample_count % radix == 0)
+		{
+			sample_count /= radix;
+		}
+	}
+
+	return sample_count == 1;
+}
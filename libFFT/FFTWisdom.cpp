@@ -0,0 +1,133 @@
+#include "FFTWisdom.h"
+#include "SimdKernels.h"
+
+#include <fftw3.h>
+
+#include <atomic>
+#include <cctype>
+#include <filesystem>
+#include <set>
+
+#ifdef _WIN32
+#include <process.h>
+#else
+#include <unistd.h>
+#endif
+
+// The planner lock only covers this process, other processes saving wisdom get their own names
+static auto tempPath(const std::string& path) ->std::string
+{
+	static std::atomic<unsigned> counter{ 0 };
+#ifdef _WIN32
+	const int pid = _getpid();
+#else
+	const int pid = getpid();
+#endif
+	return path + "." + std::to_string(pid) + "." + std::to_string(counter++) + ".tmp";
+}
+
+static std::string& wisdomDirectory()
+{
+	static std::string directory;
+	return directory;
+}
+
+auto FFTWisdom::defaultDirectory() ->std::string
+{
+	std::error_code ec;
+	auto tmp = std::filesystem::temp_directory_path(ec);
+	if (ec)
+	{
+		return "OClTools_cache";
+	}
+
+	return (tmp / "OClTools" / "cache").string();
+}
+
+void FFTWisdom::setDirectory(const std::string& directory)
+{
+	std::lock_guard<std::recursive_mutex> lock(plannerMutex());
+	wisdomDirectory() = directory;
+}
+
+auto FFTWisdom::directory() ->std::string
+{
+	std::lock_guard<std::recursive_mutex> lock(plannerMutex());
+	return wisdomDirectory().empty() ? defaultDirectory() : wisdomDirectory();
+}
+
+auto FFTWisdom::path() ->std::string
+{
+	// The brand string turned into a file name, e.g. Intel_R_Core_TM_i7_9700K_CPU_3_60GHz
+	std::string model;
+	for (char c : simd::cpuModel())
+	{
+		if (std::isalnum((unsigned char)c))
+		{
+			model.push_back(c);
+		}
+		else if (!model.empty() && model.back() != '_')
+		{
+			model.push_back('_');
+		}
+	}
+	while (!model.empty() && model.back() == '_')
+	{
+		model.pop_back();
+	}
+
+	return (std::filesystem::path(directory()) / ("fftw_wisdom_" + model + ".txt")).string();
+}
+
+auto FFTWisdom::load() ->bool
+{
+	std::lock_guard<std::recursive_mutex> lock(plannerMutex());
+
+	static std::set<std::string> loaded;
+	const std::string file = path();
+	if (!loaded.insert(file).second)
+	{
+		return true;
+	}
+
+	std::error_code ec;
+	if (!std::filesystem::exists(file, ec))
+	{
+		return false;
+	}
+
+	return fftwf_import_wisdom_from_filename(file.c_str()) != 0;
+}
+
+auto FFTWisdom::save() ->bool
+{
+	std::lock_guard<std::recursive_mutex> lock(plannerMutex());
+
+	const std::string file = path();
+	const std::string tmp_file = tempPath(file);
+
+	std::error_code ec;
+	std::filesystem::create_directories(std::filesystem::path(file).parent_path(), ec);
+
+	// Write aside and rename, so a concurrent process never imports half a file
+	if (fftwf_export_wisdom_to_filename(tmp_file.c_str()) == 0)
+	{
+		std::filesystem::remove(tmp_file, ec);
+		return false;
+	}
+
+	std::filesystem::rename(tmp_file, file, ec);
+	if (ec)
+	{
+		std::filesystem::remove(tmp_file, ec);
+		return false;
+	}
+
+	return true;
+}
+
+auto FFTWisdom::plannerMutex() ->std::recursive_mutex&
+{
+	static std::recursive_mutex mutex;
+	return mutex;
+}
@@ -0,0 +1,37 @@
+#pragma once
+#include <mutex>
+#include <string>
+
+/*!
+ * \brief FFTW wisdom kept on disk, one file per CPU model.
+ *
+ * Plans made with FFTW_MEASURE or more effort are measured once per host; the
+ * wisdom file lets every later process bake the same plans at startup. Wisdom
+ * of another FFTW build is rejected by FFTW and simply replaced.
+ */
+class FFTWisdom
+{
+public:
+	//! <temp>/OClTools/cache, next to the OpenCL program cache.
+	static auto defaultDirectory() ->std::string;
+
+	//! Where the following load() and save() calls go. Empty selects defaultDirectory().
+	static void setDirectory(const std::string& directory);
+	static auto directory() ->std::string;
+
+	//! fftw_wisdom_<cpu model>.txt in directory().
+	static auto path() ->std::string;
+
+	/*!
+	 * \brief Import the wisdom file, once per process and directory.
+	 *
+	 * Returns false when there is none or FFTW rejects it.
+	 */
+	static auto load() ->bool;
+
+	//! Export all wisdom of this process, written aside and renamed into place.
+	static auto save() ->bool;
+
+	//! The FFTW planner is not thread safe, every plan creation and destruction holds this.
+	static auto plannerMutex() ->std::recursive_mutex&;
+};
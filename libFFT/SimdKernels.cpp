@@ -0,0 +1,359 @@
+#include "SimdKernels.h"
+
+#include <cmath>
+#include <cstring>
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define SIMD_X86 1
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#endif
+#endif
+
+// MSVC emits any intrinsic anywhere, GCC and Clang only inside functions built for the instruction set
+#if defined(SIMD_X86) && !defined(_MSC_VER)
+#define SIMD_TARGET(isa) __attribute__((target(isa)))
+#else
+#define SIMD_TARGET(isa)
+#endif
+
+namespace simd
+{
+#ifdef SIMD_X86
+	static void cpuid(int leaf, int subleaf, int regs[4])
+	{
+#ifdef _MSC_VER
+		__cpuidex(regs, leaf, subleaf);
+#else
+		unsigned int a, b, c, d;
+		__cpuid_count(leaf, subleaf, a, b, c, d);
+		regs[0] = int(a); regs[1] = int(b); regs[2] = int(c); regs[3] = int(d);
+#endif
+	}
+
+	SIMD_TARGET("xsave")
+	static auto xgetbv0() ->unsigned long long
+	{
+		return _xgetbv(0);
+	}
+
+	static auto detect() ->simd_level
+	{
+		int regs[4];
+		cpuid(0, 0, regs);
+		const int max_leaf = regs[0];
+		if (max_leaf < 1)
+		{
+			return SIMD_SCALAR;
+		}
+
+		cpuid(1, 0, regs);
+		const bool sse41 = (regs[2] & (1 << 19)) != 0;
+		const bool osxsave = (regs[2] & (1 << 27)) != 0;
+		const bool avx = (regs[2] & (1 << 28)) != 0;
+		if (!sse41)
+		{
+			return SIMD_SCALAR;
+		}
+
+		// The wide registers only count when the OS saves them on a context switch
+		const unsigned long long xcr0 = osxsave ? xgetbv0() : 0;
+		if (!avx || (xcr0 & 0x6) != 0x6 || max_leaf < 7)
+		{
+			return SIMD_SSE41;
+		}
+
+		cpuid(7, 0, regs);
+		const bool avx2 = (regs[1] & (1 << 5)) != 0;
+		const bool avx512f = (regs[1] & (1 << 16)) != 0;
+		if (avx512f && (xcr0 & 0xe6) == 0xe6)
+		{
+			return SIMD_AVX512;
+		}
+
+		return avx2 ? SIMD_AVX2 : SIMD_SSE41;
+	}
+#else
+	static auto detect() ->simd_level
+	{
+		return SIMD_SCALAR;
+	}
+#endif
+
+	auto level() ->simd_level
+	{
+		static const simd_level detected = detect();
+		return detected;
+	}
+
+	auto levelName(simd_level level) ->const char*
+	{
+		switch (level)
+		{
+		case SIMD_SSE41: return "SSE4.1";
+		case SIMD_AVX2: return "AVX2";
+		case SIMD_AVX512: return "AVX-512";
+		default: return "scalar";
+		}
+	}
+
+	auto cpuModel() ->std::string
+	{
+#ifdef SIMD_X86
+		int regs[4];
+		cpuid(0x80000000, 0, regs);
+		if (unsigned(regs[0]) >= 0x80000004u)
+		{
+			char brand[49] = {};
+			for (int leaf = 0; leaf < 3; ++leaf)
+			{
+				cpuid(0x80000002 + leaf, 0, regs);
+				std::memcpy(brand + 16 * leaf, regs, sizeof(regs));
+			}
+
+			// Trim the padding some vendors put around the name
+			std::string model(brand);
+			const size_t first = model.find_first_not_of(' ');
+			const size_t last = model.find_last_not_of(' ');
+			if (first != std::string::npos)
+			{
+				return model.substr(first, last - first + 1);
+			}
+		}
+#endif
+		return "generic";
+	}
+
+	static void windowInt16Scalar(const int16_t* input, const float* window, float* output, size_t count)
+	{
+		for (size_t i = 0; i < count; ++i)
+		{
+			output[i] = float(input[i]) * window[i];
+		}
+	}
+
+#ifdef SIMD_X86
+	SIMD_TARGET("sse4.1")
+	static void windowInt16Sse41(const int16_t* input, const float* window, float* output, size_t count)
+	{
+		size_t i = 0;
+		for (; i + 8 <= count; i += 8)
+		{
+			const __m128i raw = _mm_loadu_si128((const __m128i*)(input + i));
+			const __m128 low = _mm_cvtepi32_ps(_mm_cvtepi16_epi32(raw));
+			const __m128 high = _mm_cvtepi32_ps(_mm_cvtepi16_epi32(_mm_srli_si128(raw, 8)));
+			_mm_storeu_ps(output + i, _mm_mul_ps(low, _mm_loadu_ps(window + i)));
+			_mm_storeu_ps(output + i + 4, _mm_mul_ps(high, _mm_loadu_ps(window + i + 4)));
+		}
+		windowInt16Scalar(input + i, window + i, output + i, count - i);
+	}
+
+	SIMD_TARGET("avx2")
+	static void windowInt16Avx2(const int16_t* input, const float* window, float* output, size_t count)
+	{
+		size_t i = 0;
+		for (; i + 16 <= count; i += 16)
+		{
+			const __m256i raw = _mm256_loadu_si256((const __m256i*)(input + i));
+			const __m256 low = _mm256_cvtepi32_ps(_mm256_cvtepi16_epi32(_mm256_castsi256_si128(raw)));
+			const __m256 high = _mm256_cvtepi32_ps(_mm256_cvtepi16_epi32(_mm256_extracti128_si256(raw, 1)));
+			_mm256_storeu_ps(output + i, _mm256_mul_ps(low, _mm256_loadu_ps(window + i)));
+			_mm256_storeu_ps(output + i + 8, _mm256_mul_ps(high, _mm256_loadu_ps(window + i + 8)));
+		}
+		windowInt16Scalar(input + i, window + i, output + i, count - i);
+	}
+
+	SIMD_TARGET("avx512f")
+	static void windowInt16Avx512(const int16_t* input, const float* window, float* output, size_t count)
+	{
+		size_t i = 0;
+		for (; i + 32 <= count; i += 32)
+		{
+			const __m512 low = _mm512_cvtepi32_ps(_mm512_cvtepi16_epi32(_mm256_loadu_si256((const __m256i*)(input + i))));
+			const __m512 high = _mm512_cvtepi32_ps(_mm512_cvtepi16_epi32(_mm256_loadu_si256((const __m256i*)(input + i + 16))));
+			_mm512_storeu_ps(output + i, _mm512_mul_ps(low, _mm512_loadu_ps(window + i)));
+			_mm512_storeu_ps(output + i + 16, _mm512_mul_ps(high, _mm512_loadu_ps(window + i + 16)));
+		}
+		windowInt16Scalar(input + i, window + i, output + i, count - i);
+	}
+#endif
+
+	// 10 * log10(2), and the atanh series of log2(m) = 2 / ln 2 * atanh((m - 1) / (m + 1))
+	static const float kDbPerOctave = 3.01029995664f;
+	static const float kLog2C1 = 2.88539008178f;
+	static const float kLog2C3 = 0.96179669393f;
+	static const float kLog2C5 = 0.57707801636f;
+	static const float kLog2C7 = 0.41219858311f;
+	// bits of sqrt(1/2), subtracting them moves the mantissa range to [sqrt(1/2), sqrt(2))
+	static const int32_t kSqrtHalfBits = 0x3f3504f3;
+
+	static inline float log2Fast(float x)
+	{
+		int32_t bits;
+		std::memcpy(&bits, &x, sizeof(bits));
+		const int32_t offset = bits - kSqrtHalfBits;
+		const float exponent = float(offset >> 23);
+		const int32_t mantissa_bits = (offset & 0x7fffff) + kSqrtHalfBits;
+		float m;
+		std::memcpy(&m, &mantissa_bits, sizeof(m));
+
+		const float s = (m - 1.0f) / (m + 1.0f);
+		const float s2 = s * s;
+		return exponent + s * (kLog2C1 + s2 * (kLog2C3 + s2 * (kLog2C5 + s2 * kLog2C7)));
+	}
+
+	static void powerToDbScalar(const float* bins, float* output, size_t count, float offset_db)
+	{
+		for (size_t i = 0; i < count; ++i)
+		{
+			const float power = bins[2 * i] * bins[2 * i] + bins[2 * i + 1] * bins[2 * i + 1];
+			output[i] = kDbPerOctave * log2Fast(power) + offset_db;
+		}
+	}
+
+#ifdef SIMD_X86
+	SIMD_TARGET("sse4.1")
+	static void powerToDbSse41(const float* bins, float* output, size_t count, float offset_db)
+	{
+		const __m128i sqrt_half = _mm_set1_epi32(kSqrtHalfBits);
+		const __m128i mantissa_mask = _mm_set1_epi32(0x7fffff);
+		const __m128 one = _mm_set1_ps(1.0f);
+
+		size_t i = 0;
+		for (; i + 4 <= count; i += 4)
+		{
+			const __m128 a = _mm_loadu_ps(bins + 2 * i);
+			const __m128 b = _mm_loadu_ps(bins + 2 * i + 4);
+			const __m128 power = _mm_hadd_ps(_mm_mul_ps(a, a), _mm_mul_ps(b, b));
+
+			const __m128i offset = _mm_sub_epi32(_mm_castps_si128(power), sqrt_half);
+			const __m128 exponent = _mm_cvtepi32_ps(_mm_srai_epi32(offset, 23));
+			const __m128 m = _mm_castsi128_ps(_mm_add_epi32(_mm_and_si128(offset, mantissa_mask), sqrt_half));
+			const __m128 s = _mm_div_ps(_mm_sub_ps(m, one), _mm_add_ps(m, one));
+			const __m128 s2 = _mm_mul_ps(s, s);
+			__m128 poly = _mm_add_ps(_mm_set1_ps(kLog2C5), _mm_mul_ps(s2, _mm_set1_ps(kLog2C7)));
+			poly = _mm_add_ps(_mm_set1_ps(kLog2C3), _mm_mul_ps(s2, poly));
+			poly = _mm_add_ps(_mm_set1_ps(kLog2C1), _mm_mul_ps(s2, poly));
+			const __m128 log2 = _mm_add_ps(exponent, _mm_mul_ps(s, poly));
+
+			_mm_storeu_ps(output + i, _mm_add_ps(_mm_mul_ps(_mm_set1_ps(kDbPerOctave), log2), _mm_set1_ps(offset_db)));
+		}
+		powerToDbScalar(bins + 2 * i, output + i, count - i, offset_db);
+	}
+
+	SIMD_TARGET("avx2")
+	static void powerToDbAvx2(const float* bins, float* output, size_t count, float offset_db)
+	{
+		const __m256i sqrt_half = _mm256_set1_epi32(kSqrtHalfBits);
+		const __m256i mantissa_mask = _mm256_set1_epi32(0x7fffff);
+		const __m256 one = _mm256_set1_ps(1.0f);
+
+		size_t i = 0;
+		for (; i + 8 <= count; i += 8)
+		{
+			const __m256 a = _mm256_loadu_ps(bins + 2 * i);
+			const __m256 b = _mm256_loadu_ps(bins + 2 * i + 8);
+			// hadd works per 128 bit lane, the permute restores the bin order
+			const __m256 pairs = _mm256_hadd_ps(_mm256_mul_ps(a, a), _mm256_mul_ps(b, b));
+			const __m256 power = _mm256_castpd_ps(_mm256_permute4x64_pd(_mm256_castps_pd(pairs), 0xd8));
+
+			const __m256i offset = _mm256_sub_epi32(_mm256_castps_si256(power), sqrt_half);
+			const __m256 exponent = _mm256_cvtepi32_ps(_mm256_srai_epi32(offset, 23));
+			const __m256 m = _mm256_castsi256_ps(_mm256_add_epi32(_mm256_and_si256(offset, mantissa_mask), sqrt_half));
+			const __m256 s = _mm256_div_ps(_mm256_sub_ps(m, one), _mm256_add_ps(m, one));
+			const __m256 s2 = _mm256_mul_ps(s, s);
+			__m256 poly = _mm256_add_ps(_mm256_set1_ps(kLog2C5), _mm256_mul_ps(s2, _mm256_set1_ps(kLog2C7)));
+			poly = _mm256_add_ps(_mm256_set1_ps(kLog2C3), _mm256_mul_ps(s2, poly));
+			poly = _mm256_add_ps(_mm256_set1_ps(kLog2C1), _mm256_mul_ps(s2, poly));
+			const __m256 log2 = _mm256_add_ps(exponent, _mm256_mul_ps(s, poly));
+
+			_mm256_storeu_ps(output + i, _mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(kDbPerOctave), log2), _mm256_set1_ps(offset_db)));
+		}
+		powerToDbScalar(bins + 2 * i, output + i, count - i, offset_db);
+	}
+
+	SIMD_TARGET("avx512f")
+	static void powerToDbAvx512(const float* bins, float* output, size_t count, float offset_db)
+	{
+		const __m512i sqrt_half = _mm512_set1_epi32(kSqrtHalfBits);
+		const __m512i mantissa_mask = _mm512_set1_epi32(0x7fffff);
+		const __m512 one = _mm512_set1_ps(1.0f);
+		const __m512i even = _mm512_setr_epi32(0, 2, 4, 6, 8, 10, 12, 14, 16, 18, 20, 22, 24, 26, 28, 30);
+		const __m512i odd = _mm512_setr_epi32(1, 3, 5, 7, 9, 11, 13, 15, 17, 19, 21, 23, 25, 27, 29, 31);
+
+		size_t i = 0;
+		for (; i + 16 <= count; i += 16)
+		{
+			const __m512 a = _mm512_loadu_ps(bins + 2 * i);
+			const __m512 b = _mm512_loadu_ps(bins + 2 * i + 16);
+			const __m512 re = _mm512_permutex2var_ps(a, even, b);
+			const __m512 im = _mm512_permutex2var_ps(a, odd, b);
+			const __m512 power = _mm512_add_ps(_mm512_mul_ps(re, re), _mm512_mul_ps(im, im));
+
+			const __m512i offset = _mm512_sub_epi32(_mm512_castps_si512(power), sqrt_half);
+			const __m512 exponent = _mm512_cvtepi32_ps(_mm512_srai_epi32(offset, 23));
+			const __m512 m = _mm512_castsi512_ps(_mm512_add_epi32(_mm512_and_si512(offset, mantissa_mask), sqrt_half));
+			const __m512 s = _mm512_div_ps(_mm512_sub_ps(m, one), _mm512_add_ps(m, one));
+			const __m512 s2 = _mm512_mul_ps(s, s);
+			__m512 poly = _mm512_add_ps(_mm512_set1_ps(kLog2C5), _mm512_mul_ps(s2, _mm512_set1_ps(kLog2C7)));
+			poly = _mm512_add_ps(_mm512_set1_ps(kLog2C3), _mm512_mul_ps(s2, poly));
+			poly = _mm512_add_ps(_mm512_set1_ps(kLog2C1), _mm512_mul_ps(s2, poly));
+			const __m512 log2 = _mm512_add_ps(exponent, _mm512_mul_ps(s, poly));
+
+			_mm512_storeu_ps(output + i, _mm512_add_ps(_mm512_mul_ps(_mm512_set1_ps(kDbPerOctave), log2), _mm512_set1_ps(offset_db)));
+		}
+		powerToDbScalar(bins + 2 * i, output + i, count - i, offset_db);
+	}
+#endif
+
+	void powerToDb(const float* bins, float* output, size_t count, float scale, db_precision precision)
+	{
+		if (precision == DB_EXACT)
+		{
+			for (size_t i = 0; i < count; ++i)
+			{
+				const float power = bins[2 * i] * bins[2 * i] + bins[2 * i + 1] * bins[2 * i + 1];
+				output[i] = 10.0f * std::log10(power * scale);
+			}
+			return;
+		}
+
+		typedef void (*db_fn)(const float*, float*, size_t, float);
+		static const db_fn selected = []() ->db_fn
+		{
+			switch (level())
+			{
+#ifdef SIMD_X86
+			case SIMD_AVX512: return powerToDbAvx512;
+			case SIMD_AVX2: return powerToDbAvx2;
+			case SIMD_SSE41: return powerToDbSse41;
+#endif
+			default: return powerToDbScalar;
+			}
+		}();
+
+		selected(bins, output, count, float(10.0 * std::log10(double(scale))));
+	}
+
+	void windowInt16(const int16_t* input, const float* window, float* output, size_t count)
+	{
+		typedef void (*window_fn)(const int16_t*, const float*, float*, size_t);
+		static const window_fn selected = []() ->window_fn
+		{
+			switch (level())
+			{
+#ifdef SIMD_X86
+			case SIMD_AVX512: return windowInt16Avx512;
+			case SIMD_AVX2: return windowInt16Avx2;
+			case SIMD_SSE41: return windowInt16Sse41;
+#endif
+			default: return windowInt16Scalar;
+			}
+		}();
+
+		selected(input, window, output, count);
+	}
+}
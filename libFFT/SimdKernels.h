@@ -0,0 +1,55 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+/*!
+ * \brief Hot loops of FFTCpu with SSE4.1, AVX2 and AVX-512 versions.
+ *
+ * The widest version the CPU and the OS support is picked on first use; every
+ * version produces the same result as the scalar one.
+ */
+namespace simd
+{
+	enum simd_level {
+		SIMD_SCALAR = 0,
+		SIMD_SSE41 = 1,
+		SIMD_AVX2 = 2,
+		SIMD_AVX512 = 3,
+	};
+
+	//! Widest instruction set the kernels use on this machine.
+	auto level() ->simd_level;
+	auto levelName(simd_level level) ->const char*;
+
+	//! cpuid brand string, e.g. for caches that are only valid on one CPU model. "generic" off x86.
+	auto cpuModel() ->std::string;
+
+	/*!
+	 * \brief output[i] = input[i] * window[i] for count int16 values.
+	 *
+	 * For complex samples count is twice the sample count and window holds
+	 * every weight twice, already scaled by 1 / 32768.
+	 */
+	void windowInt16(const int16_t* input, const float* window, float* output, size_t count);
+
+	/*!
+	 * \brief Accuracy of powerToDb().
+	 */
+	enum db_precision {
+		DB_EXACT = 0, //!< std::log10 per value
+		DB_FAST = 1,  //!< vectorised log2, see powerToDb()
+	};
+
+	/*!
+	 * \brief output[i] = 10 * log10(|bins[i]|^2 * scale) for count complex bins.
+	 *
+	 * bins are interleaved re / im floats. DB_FAST splits the power into
+	 * exponent and a mantissa in [sqrt(1/2), sqrt(2)) and evaluates log2 of the
+	 * mantissa with four terms of the atanh series; the truncation error is
+	 * below 2e-7 dB, float rounding keeps the result within 1e-4 dB of DB_EXACT
+	 * down to -300 dB. A power of 0 gives about -382 dB plus the scale instead of
+	 * -inf. The scale is folded into one dB offset.
+	 */
+	void powerToDb(const float* bins, float* output, size_t count, float scale, db_precision precision);
+}
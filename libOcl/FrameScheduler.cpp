@@ -0,0 +1,138 @@
+#include "FrameScheduler.h"
+#include "PlatformDeviceEnum.h"
+
+#include "../libFFT/AllignedBufferF.h"
+#include "../libFFT/AllignedBufferI16C.h"
+
+#include <algorithm>
+
+namespace ocl
+{
+	// Weight of the newest frame in the per-device running average
+	static const double cost_smoothing = 0.2;
+
+	auto FrameScheduler::create(size_t sample_count, const WindowFunction::win_type win_type, const ProcessingOptions& options, const RuntimeOptions& runtime_options) ->std::shared_ptr<FrameScheduler>
+	{
+		std::shared_ptr<FrameScheduler> obj = std::shared_ptr<FrameScheduler>(new FrameScheduler);
+		obj->in_flight_ = options.in_flight;
+
+		// Queue wait behind another device's frame is not work, so frames are timed on the device
+		ProcessingOptions module_options = options;
+		module_options.profiling = true;
+
+		for (const auto& pl_dev : PlatformDeviceEnum::enumPlatform())
+		{
+			// Devices without a working compiler or clFFT support are simply left out
+			auto runtime = Runtime::create(pl_dev->getDevice(), runtime_options);
+			if (!runtime)
+			{
+				continue;
+			}
+
+			auto module = ModuleSignalProcessing::create(runtime, sample_count, win_type, module_options);
+			if (!module)
+			{
+				continue;
+			}
+
+			Device device;
+			device.module_ = module;
+			obj->devices_.push_back(std::move(device));
+		}
+
+		if (obj->devices_.empty())
+		{
+			return {};
+		}
+
+		return obj;
+	}
+
+	auto FrameScheduler::submit(const std::shared_ptr<AllignedBufferI16C>& rawData) ->bool
+	{
+		// Expected completion is the device's backlog plus this frame, in its own time per frame.
+		// Unmeasured devices cost nothing, so each one gets a frame early on and is measured.
+		std::vector<std::pair<double, size_t>> candidates;
+		for (size_t index = 0; index < devices_.size(); ++index)
+		{
+			const auto& device = devices_[index];
+			if (device.submitted_.size() < in_flight_)
+			{
+				candidates.emplace_back((device.submitted_.size() + 1) * device.seconds_per_frame_, index);
+			}
+		}
+		std::stable_sort(candidates.begin(), candidates.end(), [](const std::pair<double, size_t>& a, const std::pair<double, size_t>& b) { return a.first < b.first; });
+
+		for (const auto& candidate : candidates)
+		{
+			auto& device = devices_[candidate.second];
+			if (device.module_->submit(rawData))
+			{
+				device.submitted_.push_back(clock::now());
+				order_.push_back(candidate.second);
+				return true;
+			}
+		}
+
+		return false;
+	}
+
+	auto FrameScheduler::wait() ->std::shared_ptr<AllignedBufferF>
+	{
+		if (order_.empty())
+		{
+			return {};
+		}
+
+		auto& device = devices_[order_.front()];
+		order_.pop_front();
+
+		auto retBuffer = device.module_->wait();
+
+		// A frame occupies the device from its submission or from the end of the
+		// previous frame, whichever is later; the rest is queueing, not work
+		const auto done = clock::now();
+		const auto start = std::max(device.submitted_.front(), device.last_done_);
+		device.submitted_.pop_front();
+		device.last_done_ = done;
+
+		// Without profiling timestamps fall back to the host clock
+		double seconds = device.module_->lastDeviceSeconds();
+		if (seconds <= 0.0)
+		{
+			seconds = std::chrono::duration<double>(done - start).count();
+		}
+		if (device.seconds_per_frame_ == 0.0)
+		{
+			device.seconds_per_frame_ = seconds;
+		}
+		else
+		{
+			device.seconds_per_frame_ += cost_smoothing * (seconds - device.seconds_per_frame_);
+		}
+
+		return retBuffer;
+	}
+
+	auto FrameScheduler::performAsync(const std::shared_ptr<AllignedBufferI16C>& rawData, std::shared_ptr<AllignedBufferF>& retBuffer) ->bool
+	{
+		retBuffer.reset();
+		if (order_.size() == in_flight_ * devices_.size())
+		{
+			retBuffer = wait();
+		}
+
+		return submit(rawData);
+	}
+
+	auto FrameScheduler::throughput() const ->std::vector<double>
+	{
+		std::vector<double> frames_per_second;
+		for (const auto& device : devices_)
+		{
+			frames_per_second.push_back(device.seconds_per_frame_ > 0.0 ? 1.0 / device.seconds_per_frame_ : 0.0);
+		}
+
+		return frames_per_second;
+	}
+}
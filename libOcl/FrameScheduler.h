@@ -0,0 +1,81 @@
+#pragma once
+
+#include "ModuleSignalProcessing.h"
+#include "Runtime.h"
+
+#include <chrono>
+#include <deque>
+#include <memory>
+#include <vector>
+
+class AllignedBufferF;
+class AllignedBufferI16C;
+
+namespace ocl
+{
+	/*!
+	 * \brief Spreads frames over one ModuleSignalProcessing per usable OpenCL device.
+	 *
+	 * Every device found by PlatformDeviceEnum::enumPlatform() that builds a
+	 * pipeline takes part. A frame goes to the device expected to finish it
+	 * first, judged by a running average of each device's time per frame, and
+	 * wait() hands the spectra back in submission order. The modules run with
+	 * profiling enabled, a frame is timed by its own commands on the device.
+	 */
+	class FrameScheduler
+	{
+		FrameScheduler() = default;
+	public:
+		~FrameScheduler() = default;
+
+		//! Returns nullptr when no device builds a pipeline.
+		static auto create(size_t sample_count, const WindowFunction::win_type win_type, const ProcessingOptions& options = {}, const RuntimeOptions& runtime_options = {}) ->std::shared_ptr<FrameScheduler>;
+
+		/*!
+		 * \brief Hand rawData to the device expected to finish it first.
+		 *
+		 * A device that rejects the frame passes it on to the next best one.
+		 * Returns false when every device already holds in_flight frames (call
+		 * wait() first) or none of them accepts it.
+		 */
+		auto submit(const std::shared_ptr<AllignedBufferI16C>& rawData) ->bool;
+
+		/*!
+		 * \brief Spectrum of the oldest submitted frame, whichever device ran it.
+		 *
+		 * Returns nullptr when nothing is pending.
+		 */
+		auto wait() ->std::shared_ptr<AllignedBufferF>;
+
+		/*!
+		 * \brief submit() rawData and, once every device is busy, collect the
+		 * oldest finished frame into retBuffer first.
+		 *
+		 * Returns the result of submit().
+		 */
+		auto performAsync(const std::shared_ptr<AllignedBufferI16C>& rawData, std::shared_ptr<AllignedBufferF>& retBuffer) ->bool;
+
+		size_t deviceCount() const { return devices_.size(); }
+		auto module(size_t device) const ->const std::shared_ptr<ModuleSignalProcessing>& { return devices_[device].module_; }
+
+		//! Measured frames per second of every device, 0 until its first frame is back.
+		auto throughput() const ->std::vector<double>;
+
+		size_t pending() const { return order_.size(); }
+
+	private:
+		using clock = std::chrono::steady_clock;
+
+		struct Device
+		{
+			std::shared_ptr<ModuleSignalProcessing> module_;
+			std::deque<clock::time_point> submitted_;
+			clock::time_point last_done_;
+			double seconds_per_frame_{ 0.0 }; // running average, 0 while unmeasured
+		};
+
+		std::vector<Device> devices_;
+		std::deque<size_t> order_; // device of every pending frame, oldest first
+		size_t in_flight_{ 1 };
+	};
+}
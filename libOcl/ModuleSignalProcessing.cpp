@@ -1,10 +1,15 @@
 #include "ModuleSignalProcessing.h"
+#include "Runtime.h"
+#include "WorkGroupTuner.h"
 
 
 
 #include "../libFFT/AllignedBufferI16C.h"
 #include "../libFFT/AllignedBufferF.h"
+#include "../libFFT/AllignedBufferF16.h"
 #include "../libFFT/AllignedBufferFC.h"
+#include "../libFFT/AllignedBufferI16.h"
+#include "../libFFT/FFTCpu.h"
 
 #define CL_HPP_MINIMUM_OPENCL_VERSION 120
 #define CL_HPP_TARGET_OPENCL_VERSION 120
@@ -12,6 +17,14 @@
 #include <CL/cl2.hpp>
 #include <clFFT.h>
 
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <map>
+#include <mutex>
+#include <random>
+
 namespace ocl
 {
 	static std::string vectorMultiplicationCode{
@@ -24,11 +37,22 @@ namespace ocl
         __kernel void vectorMultiplication(
 		__global const  cl_short_complex* a,
 		__global const  float* b,
-		__global cl_complex* c)
+		__global cl_complex* c,
+		const int count,
+		const int stride)
 		{
-			int threadId = get_global_id(0); // OpenCL function
-			c[threadId].x = a[threadId].x * b[threadId];
-			c[threadId].y = a[threadId].y * b[threadId];
+			// dimension 0 walks the count samples of a frame, padded up to whole work-groups,
+			// dimension 1 the frames of a batch. Input frames start stride samples apart,
+			// less than count when they overlap.
+			int sampleId = get_global_id(0);
+			if (sampleId >= count)
+			{
+				return;
+			}
+			int threadId = get_global_id(1) * count + sampleId;
+			int inputId = get_global_id(1) * stride + sampleId;
+			c[threadId].x = a[inputId].x * b[sampleId];
+			c[threadId].y = a[inputId].y * b[sampleId];
 		}
 		)CLC" };
 
@@ -59,284 +83,2371 @@ namespace ocl
 	R"CLC(
         __kernel void PostProcessCode(
 		__global const  float2* input,
-		__global float* output)
+		__global float* power,
+		__global float* output,
+		const int count,
+		__global float* traces,
+		const int trace_mask,
+		const float decay,
+		const int reset,
+		__global half* output_half,
+		__global short* output_centi)
 		{
-			const int threadId = get_global_id(0);
-			const int count = get_global_size(0);
-			float ratio_power = .5f / count;
-			
-			float2 sample1 = input[threadId] *ratio_power ;
-			output[threadId + count] = 20.0f * log10( sqrt( sample1.x *sample1.x +  sample1.y * sample1.y));
-			
-			float2 sample2 = input[threadId + count] *ratio_power;
-			output[threadId ] = 20.0f * log10( sqrt( sample2.x *sample2.x +  sample2.y * sample2.y));
-			
+			// power and the three dB outputs are optional, the host passes NULL for stages it does not want.
+			// One bin per work-item, dimension 0 is padded up to whole work-groups.
+			const int bin = get_global_id(0);
+			if (bin >= count)
+			{
+				return;
+			}
+			const int frame = get_global_id(1) * count;
+			float ratio_power = 1.0f / count;
+
+			// fftshift, DC lands at count / 2 for even and odd sizes alike
+			const int shifted = frame + (bin + count / 2) % count;
+
+			float2 sample = input[frame + bin] *ratio_power ;
+			float value = sample.x *sample.x +  sample.y * sample.y;
+
+			if (power != 0)
+			{
+				power[shifted] = value;
+			}
+			if (output != 0 || output_half != 0 || output_centi != 0)
+			{
+				const float db = 10.0f * LOG10( value);
+				if (output != 0)
+				{
+					output[shifted] = db;
+				}
+				if (output_half != 0)
+				{
+					vstore_half(db, shifted, output_half);
+				}
+				if (output_centi != 0)
+				{
+					output_centi[shifted] = convert_short_sat_rte(100.0f * db);
+				}
+			}
+
+			// traces holds max-hold, min-hold and persistence of count bins each. The work-items
+			// of the first frame fold in every frame of the batch, so no two items share a bin.
+			if (trace_mask != 0 && get_global_id(1) == 0)
+			{
+				const int trace_bin = shifted;
+				float hold_max = traces[trace_bin];
+				float hold_min = traces[count + trace_bin];
+				float persist = traces[2 * count + trace_bin];
+
+				for (int f = 0; f < get_global_size(1); ++f)
+				{
+					float2 s = input[f * count + bin] * ratio_power;
+					float db = 10.0f * LOG10(s.x * s.x + s.y * s.y);
+					if (reset && f == 0)
+					{
+						hold_max = hold_min = persist = db;
+					}
+					else
+					{
+						hold_max = fmax(hold_max, db);
+						hold_min = fmin(hold_min, db);
+						persist = fmax(db, persist - decay);
+					}
+				}
+
+				if (trace_mask & 1) traces[trace_bin] = hold_max;
+				if (trace_mask & 2) traces[count + trace_bin] = hold_min;
+				if (trace_mask & 4) traces[2 * count + trace_bin] = persist;
+			}
 		}
 		)CLC" };
 
-	ModuleSignalProcessing::~ModuleSignalProcessing()
-	{
-		cl_int ret;
+	// Build options of a kernel variant override these defaults, see createKernels()
+	static std::string KernelConfigCode{
+	R"CLC(
+		#ifndef WIDTH
+		#define WIDTH 4
+		#endif
+		#ifndef LOG10
+		#define LOG10 log10
+		#endif
+		)CLC" };
 
-		/* Release clFFT library. */
-		ret = clfftDestroyPlan(&planHandle_);
-		clfftTeardown();
-		delete fftSetup_;
+	// WIDTH complex samples per work-item, loaded and stored as one vector
+	static std::string VectorKernelCode{
+	R"CLC(
+		#if WIDTH == 4
+		typedef float4 floatw;
+		typedef float8 floatw2;
+		#define vloadw vload4
+		#define vstorew vstore4
+		#define vloadw2 vload8
+		#define vstorew2 vstore8
+		#define convert_floatw2 convert_float8
+		#define convert_shortw_sat_rte convert_short4_sat_rte
+		#define vstorew_half vstore_half4
+		#define SPREAD(w) (floatw2)(w.s0, w.s0, w.s1, w.s1, w.s2, w.s2, w.s3, w.s3)
+		#else
+		typedef float8 floatw;
+		typedef float16 floatw2;
+		#define vloadw vload8
+		#define vstorew vstore8
+		#define vloadw2 vload16
+		#define vstorew2 vstore16
+		#define convert_floatw2 convert_float16
+		#define convert_shortw_sat_rte convert_short8_sat_rte
+		#define vstorew_half vstore_half8
+		#define SPREAD(w) (floatw2)(w.s0, w.s0, w.s1, w.s1, w.s2, w.s2, w.s3, w.s3, w.s4, w.s4, w.s5, w.s5, w.s6, w.s6, w.s7, w.s7)
+		#endif
+
+        __kernel void vectorMultiplicationVec(
+		__global const  short* a,
+		__global const  float* b,
+		__global float* c,
+		const int count,
+		const int stride)
+		{
+			// dimension 0 walks the count groups of WIDTH samples, padded up to whole
+			// work-groups, dimension 1 the frames of a batch. Input frames start stride
+			// samples apart, which need not be a multiple of WIDTH.
+			int groupId = get_global_id(0);
+			if (groupId >= count)
+			{
+				return;
+			}
+			int threadId = get_global_id(1) * count + groupId;
+			floatw window = vloadw(groupId, b);
+			__global const short* input = a + 2 * (get_global_id(1) * stride + groupId * WIDTH);
+			vstorew2(convert_floatw2(vloadw2(0, input)) * SPREAD(window), threadId, c);
+		}
 
-		ret = clFlush(command_queue_);
-		ret = clFinish(command_queue_);
-		ret = clReleaseKernel(kernel_postprocess_);
-		ret = clReleaseKernel(kernel_preprocess_);
-		ret = clReleaseProgram(program_);
+        __kernel void PostProcessVec(
+		__global const  float* input,
+		__global float* power,
+		__global float* output,
+		const int groups,
+		__global float* traces,
+		const int trace_mask,
+		const float decay,
+		const int reset,
+		__global half* output_half,
+		__global short* output_centi)
+		{
+			// power and the three dB outputs are optional, the host passes NULL for stages it does not want.
+			// Each work-item takes WIDTH bins of both halves, groups of them cover half a frame.
+			if (get_global_id(0) >= groups)
+			{
+				return;
+			}
+			const int count = groups * WIDTH;
+			const int threadId = get_global_id(1) * 2 * count + get_global_id(0) * WIDTH;
+			float ratio_power = .5f / count;
 
-		ret = clReleaseMemObject(mem_obj_input_);
-		ret = clReleaseMemObject(mem_obj_window_);
-		ret = clReleaseMemObject(mem_obj_fft_);
-		ret = clReleaseMemObject(signal_power_out_);
+			floatw2 sample1 = vloadw2(0, input + 2 * threadId) * ratio_power;
+			floatw power1 = sample1.even * sample1.even + sample1.odd * sample1.odd;
 
-		ret = clReleaseCommandQueue(command_queue_);
-		ret = clReleaseContext(context_);
-	}
+			floatw2 sample2 = vloadw2(0, input + 2 * (threadId + count)) * ratio_power;
+			floatw power2 = sample2.even * sample2.even + sample2.odd * sample2.odd;
 
-	auto ModuleSignalProcessing::create(size_t sample_count, const WindowFunction::win_type win_type) ->std::shared_ptr<ModuleSignalProcessing>
-	{
+			if (power != 0)
+			{
+				vstorew(power1, 0, power + threadId + count);
+				vstorew(power2, 0, power + threadId);
+			}
+			if (output != 0 || output_half != 0 || output_centi != 0)
+			{
+				floatw db1 = 10.0f * LOG10(power1);
+				floatw db2 = 10.0f * LOG10(power2);
+				if (output != 0)
+				{
+					vstorew(db1, 0, output + threadId + count);
+					vstorew(db2, 0, output + threadId);
+				}
+				if (output_half != 0)
+				{
+					vstorew_half(db1, 0, output_half + threadId + count);
+					vstorew_half(db2, 0, output_half + threadId);
+				}
+				if (output_centi != 0)
+				{
+					vstorew(convert_shortw_sat_rte(100.0f * db1), 0, output_centi + threadId + count);
+					vstorew(convert_shortw_sat_rte(100.0f * db2), 0, output_centi + threadId);
+				}
+			}
 
-		auto window_vec = WindowFunction::build(win_type, int(sample_count), 0);
-		for (int i = 0; i < int(sample_count); ++i)
-		{
-			window_vec[i] = window_vec[i] / 32768.0f;
+			// Same trace update as PostProcessCode, WIDTH bins of each half at a time
+			if (trace_mask != 0 && get_global_id(1) == 0)
+			{
+				const int bins = 2 * count;
+				for (int half = 0; half < 2; ++half)
+				{
+					// fftshift, the lower half of the bins moves up and the upper half down
+					const int input_bin = threadId + half * count;
+					const int trace_bin = threadId + (1 - half) * count;
+					floatw hold_max = vloadw(0, traces + trace_bin);
+					floatw hold_min = vloadw(0, traces + bins + trace_bin);
+					floatw persist = vloadw(0, traces + 2 * bins + trace_bin);
+
+					for (int f = 0; f < get_global_size(1); ++f)
+					{
+						floatw2 s = vloadw2(0, input + 2 * (f * bins + input_bin)) * ratio_power;
+						floatw db = 10.0f * LOG10(s.even * s.even + s.odd * s.odd);
+						if (reset && f == 0)
+						{
+							hold_max = hold_min = persist = db;
+						}
+						else
+						{
+							hold_max = fmax(hold_max, db);
+							hold_min = fmin(hold_min, db);
+							persist = fmax(db, persist - decay);
+						}
+					}
+
+					if (trace_mask & 1) vstorew(hold_max, 0, traces + trace_bin);
+					if (trace_mask & 2) vstorew(hold_min, 0, traces + bins + trace_bin);
+					if (trace_mask & 4) vstorew(persist, 0, traces + 2 * bins + trace_bin);
+				}
+			}
 		}
+		)CLC" };
+
+	// OUTPUT_DISPLAY: reduce the dB spectrum to one bucket per pixel before it is downloaded
+	static std::string DisplayCode{
+	R"CLC(
+        __kernel void DecimateDb(
+		__global const float* db,
+		__global float* display,
+		const int count,
+		const int first,
+		const int span,
+		const int buckets,
+		const int reduction)
+		{
+			// dimension 0 walks the buckets, dimension 1 the frames of a batch
+			const int bucket = get_global_id(0);
+			if (bucket >= buckets)
+			{
+				return;
+			}
+			const int frame = get_global_id(1);
+			__global const float* input = db + frame * count + first;
 
+			const int start = (int)((long)bucket * span / buckets);
+			const int end = max(start + 1, (int)((long)(bucket + 1) * span / buckets));
 
+			float low = input[start];
+			float high = low;
+			float sum = 0.0f;
+			for (int bin = start; bin < end; ++bin)
+			{
+				const float value = input[bin];
+				low = fmin(low, value);
+				high = fmax(high, value);
+				sum += exp10(0.1f * value);
+			}
 
-		// Filter for a 2.0 platform and set it as the default
-		std::vector<cl::Platform> platforms;
-		cl::Platform::get(&platforms);
-		cl::Platform plat;
+			if (reduction == 2)
+			{
+				display[2 * (frame * buckets + bucket)] = low;
+				display[2 * (frame * buckets + bucket) + 1] = high;
+			}
+			else
+			{
+				display[frame * buckets + bucket] = reduction == 1 ? 10.0f * LOG10(sum / (end - start)) : high;
+			}
+		}
+		)CLC" };
 
-		for (auto& p : platforms)
+	// OUTPUT_PEAKS: collect the local maxima above a threshold, then select the strongest per frame
+	static std::string PeakCode{
+	R"CLC(
+		typedef struct
 		{
-			std::string pl_profile = p.getInfo<CL_PLATFORM_PROFILE>();
-			std::string pl_version = p.getInfo<CL_PLATFORM_VERSION>();
-			std::string pl_name = p.getInfo<CL_PLATFORM_NAME>();
-			std::string pl_vendor = p.getInfo<CL_PLATFORM_VENDOR>();
+			int bin;
+			float db;
+			float offset;
+		} Peak;
+
+        __kernel void PeakCandidates(
+		__global const float* db,
+		__global int* candidate_bins,
+		__global float* candidate_db,
+		__global int* candidate_count,
+		const int count,
+		const int capacity,
+		const float threshold)
+		{
+			// dimension 0 walks the bins, dimension 1 the frames of a batch. A candidate is
+			// strictly above its left neighbour, so at most every other bin, capacity is count / 2.
+			const int bin = get_global_id(0);
+			if (bin < 1 || bin >= count - 1)
+			{
+				return;
+			}
+			const int frame = get_global_id(1);
+			__global const float* spectrum = db + frame * count;
 
+			const float value = spectrum[bin];
+			if (value > threshold && value > spectrum[bin - 1] && value >= spectrum[bin + 1])
+			{
+				const int index = atomic_inc(candidate_count + frame);
+				if (index < capacity)
+				{
+					candidate_bins[frame * capacity + index] = bin;
+					candidate_db[frame * capacity + index] = value;
+				}
+			}
+		}
 
-			//printf("pl_profile = %s\n", p.getInfo<CL_PLATFORM_PROFILE>().c_str());
-			//printf("pl_version =  %s\n", p.getInfo<CL_PLATFORM_VERSION>().c_str());
-			//printf("pl_name =  %s\n", p.getInfo<CL_PLATFORM_NAME>().c_str());
-			//printf("pl_vendor =  %s\n", p.getInfo<CL_PLATFORM_VENDOR>().c_str());
+		// Quinn's second estimator, only valid for unwindowed bins
+		float quinnTau(float x)
+		{
+			return 0.25f * log(3.0f * x * x + 6.0f * x + 1.0f) - 0.10206207f * log((x + 1.0f - 0.81649658f) / (x + 1.0f + 0.81649658f));
+		}
 
+        __kernel void PeakTopK(
+		__global const float* db,
+		__global const float2* bins,
+		__global const int* candidate_bins,
+		__global float* candidate_db,
+		__global const int* candidate_count,
+		__global Peak* peaks,
+		const int count,
+		const int capacity,
+		const int peak_count,
+		const int quinn,
+		__local float* best_db,
+		__local int* best_index)
+		{
+			// One work-group per frame picks the strongest candidate peak_count times, a selected one
+			// is overwritten with -FLT_MAX in the candidate list; db is only read, it is the returned
+			// spectrum in zero copy mode.
+			const int frame = get_group_id(1);
+			const int lid = get_local_id(0);
+			const int local_size = get_local_size(0);
+			const int available = min(candidate_count[frame], capacity);
+			__global const float* spectrum = db + frame * count;
+			__global const int* frame_bins = candidate_bins + frame * capacity;
+			__global float* frame_db = candidate_db + frame * capacity;
+
+			for (int k = 0; k < peak_count; ++k)
+			{
+				float best = -FLT_MAX;
+				int at = -1;
+				for (int index = lid; index < available; index += local_size)
+				{
+					if (frame_db[index] > best)
+					{
+						best = frame_db[index];
+						at = index;
+					}
+				}
+				best_db[lid] = best;
+				best_index[lid] = at;
+				barrier(CLK_LOCAL_MEM_FENCE);
+
+				for (int stride = local_size / 2; stride > 0; stride >>= 1)
+				{
+					if (lid < stride && best_db[lid + stride] > best_db[lid])
+					{
+						best_db[lid] = best_db[lid + stride];
+						best_index[lid] = best_index[lid + stride];
+					}
+					barrier(CLK_LOCAL_MEM_FENCE);
+				}
+
+				if (lid == 0)
+				{
+					Peak peak = { -1, -FLT_MAX, 0.0f };
+					if (best_index[0] >= 0)
+					{
+						const int bin = frame_bins[best_index[0]];
+						const float left = spectrum[bin - 1];
+						const float centre = spectrum[bin];
+						const float right = spectrum[bin + 1];
+						peak.bin = bin;
+						peak.db = centre;
+
+						if (quinn)
+						{
+							// The complex bins are in natural order, undo the fftshift
+							__global const float2* fft = bins + frame * count;
+							const int natural = (bin + count - count / 2) % count;
+							const float2 x = fft[natural];
+							const float2 xm = fft[(natural + count - 1) % count];
+							const float2 xp = fft[(natural + 1) % count];
+							const float norm = dot(x, x);
+							const float ap = dot(xp, x) / norm;
+							const float am = dot(xm, x) / norm;
+							const float dp = -ap / (1.0f - ap);
+							const float dm = am / (1.0f - am);
+							peak.offset = 0.5f * (dp + dm) + quinnTau(dp * dp) - quinnTau(dm * dm);
+						}
+						else
+						{
+							const float curvature = left - 2.0f * centre + right;
+							if (curvature != 0.0f)
+							{
+								peak.offset = 0.5f * (left - right) / curvature;
+								peak.db = centre - 0.25f * (left - right) * peak.offset;
+							}
+						}
+
+						frame_db[best_index[0]] = -FLT_MAX;
+					}
+					peaks[frame * peak_count + k] = peak;
+				}
+				barrier(CLK_LOCAL_MEM_FENCE | CLK_GLOBAL_MEM_FENCE);
+			}
+		}
+		)CLC" };
 
-			if (pl_vendor.find("NVIDIA ") != std::string::npos)
+	// Welch averaging: window the overlapping segments, accumulate their power, convert once
+	static std::string WelchCode{
+	R"CLC(
+        __kernel void WelchSegments(
+		__global const short2* history,
+		__global const float* window,
+		__global float2* segments,
+		const int count,
+		const int hop,
+		const int segment_count,
+		const int first)
+		{
+			// dimension 0 walks the count samples of a segment, dimension 1 the segments from first on.
+			// The last segment is the newest frame, which sits behind the previous one in history.
+			const int sampleId = get_global_id(0);
+			if (sampleId >= count)
 			{
-				plat = p;
-				break;
+				return;
 			}
+			const int segment = first + get_global_id(1);
+			const int start = count - (segment_count - 1 - segment) * hop;
 
+			short2 sample = history[start + sampleId];
+			float w = window[sampleId];
+			segments[segment * count + sampleId] = (float2)(sample.x * w, sample.y * w);
+		}
 
-			if (pl_vendor.find("AND") != std::string::npos)
+        __kernel void WelchAccumulate(
+		__global const float2* segments,
+		__global float* accumulator,
+		const int count,
+		const int first,
+		const int segment_count,
+		const int exponential,
+		const float alpha,
+		const int reset)
+		{
+			const int bin = get_global_id(0);
+			if (bin >= count)
 			{
-				plat = p;
-				break;
+				return;
 			}
+			float ratio_power = 1.0f / count;
 
-			if (pl_vendor.find("Intel") != std::string::npos)
+			float acc = reset ? 0.0f : accumulator[bin];
+			for (int segment = first; segment < segment_count; ++segment)
 			{
-				plat = p;
-				break;
+				float2 sample = segments[segment * count + bin] * ratio_power;
+				float value = sample.x * sample.x + sample.y * sample.y;
+				if (!exponential)
+				{
+					acc += value;
+				}
+				else if (reset && segment == first)
+				{
+					acc = value;
+				}
+				else
+				{
+					acc += alpha * (value - acc);
+				}
 			}
+			accumulator[bin] = acc;
 		}
 
-		//printf("pl_profile = %s\n" , plat.getInfo<CL_PLATFORM_PROFILE>().c_str());
-		//printf("pl_version =  %s\n", plat.getInfo<CL_PLATFORM_VERSION>().c_str());
-		//printf("pl_name =  %s\n", plat.getInfo<CL_PLATFORM_NAME>().c_str());
-		//printf("pl_vendor =  %s\n", plat.getInfo<CL_PLATFORM_VENDOR>().c_str());
+        __kernel void WelchOutput(
+		__global const float* accumulator,
+		__global float* power,
+		__global float* output,
+		const int count,
+		const float scale)
+		{
+			// power and output are optional, the host passes NULL for stages it does not want
+			const int bin = get_global_id(0);
+			if (bin >= count)
+			{
+				return;
+			}
+			const int shifted = (bin + count / 2) % count;
 
-		std::vector<cl::Device> device;
-		plat.getDevices(CL_DEVICE_TYPE_GPU, &device);
+			float value = accumulator[bin] * scale;
+			if (power != 0)
+			{
+				power[shifted] = value;
+			}
+			if (output != 0)
+			{
+				output[shifted] = 10.0f * LOG10(value);
+			}
+		}
+		)CLC" };
 
-		if (device.empty() )
+	// clFFT plan callbacks for the fused mode, SAMPLE_COUNT is prepended by bakeFusedPlan().
+	// The input buffer holds short2 samples even though the plan layout says float2.
+	static std::string FusedWindowLoadCode{
+	R"CLC(
+		float2 fusedWindowLoad(__global void* input, uint inoffset, __global void* userdata)
 		{
-			plat.getDevices(CL_DEVICE_TYPE_CPU, &device);
+			short2 sample = ((__global short2*)input)[inoffset];
+			float window = ((__global float*)userdata)[inoffset % SAMPLE_COUNT];
+			return (float2)(sample.x * window, sample.y * window);
 		}
-		if (device.size() == 0)
+		)CLC" };
+
+	static std::string FusedDbStoreCode{
+	R"CLC(
+		void fusedDbStore(__global void* output, uint outoffset, __global void* userdata, float2 fftoutput)
 		{
-			return {};
+			uint bin = outoffset % SAMPLE_COUNT;
+			uint frame_start = outoffset - bin;
+			float2 sample = fftoutput * (1.0f / SAMPLE_COUNT);
+			((__global float*)userdata)[frame_start + (bin + SAMPLE_COUNT / 2) % SAMPLE_COUNT] = 10.0f * log10(sample.x * sample.x + sample.y * sample.y);
 		}
+		)CLC" };
 
-		//std::string platver = p.getInfo<CL_PLATFORM_VERSION>();
+	static_assert(sizeof(Peak) == 12, "Peak is downloaded as the Peak struct of PeakCode");
 
+	//! Aligned host memory wrapped by a CL_MEM_USE_HOST_PTR buffer. While mapped the
+	//! host owns it; the destructor unmaps it and the cl_mem destructor callback frees it.
+	struct ModuleSignalProcessing::HostMapping
+	{
+		cl_command_queue queue_{ nullptr };
+		cl_mem mem_{ nullptr };
+		void* ptr_{ nullptr };
+		size_t bytes_{ 0 };
+		bool mapped_{ false };
+		bool in_flight_{ false }; // an input frame between submit() and wait()
+
+		~HostMapping()
+		{
+			if (mapped_)
+			{
+				clEnqueueUnmapMemObject(queue_, mem_, ptr_, 0, NULL, NULL);
+			}
+			if (mem_ != nullptr) clReleaseMemObject(mem_);
+			if (queue_ != nullptr) clReleaseCommandQueue(queue_);
+		}
+	};
 
-		//device[0].
-		//////////////////////////////////////////////////////////////////////////
+	//! Frames handed out by allocateInput(), so submit() can recognise them.
+	struct ModuleSignalProcessing::HostRegistry
+	{
+		std::mutex mutex_;
+		std::map<const void*, std::weak_ptr<HostMapping>> inputs_;
+	};
+
+	//! Global size covering items with whole work-groups of local, the kernels skip the excess
+	static auto roundUp(cl_int items, size_t local) ->size_t
+	{
+		if (local == 0)
+		{
+			return size_t(items);
+		}
+
+		return (size_t(items) + local - 1) / local * local;
+	}
 
-		auto device_id = device[0].get();
+	static void CL_CALLBACK freeHostMemory(cl_mem, void* user_data)
+	{
+		std::free(user_data);
+	}
 
+	ModuleSignalProcessing::~ModuleSignalProcessing()
+	{
 		cl_int ret;
 
-		// Create an OpenCL context
-		cl_context context = clCreateContext(NULL, 1, &device_id, NULL, NULL, &ret);
-		if (ret != CL_SUCCESS)
+		if (command_queue_ != nullptr)
 		{
-			return {};
+			ret = clFlush(command_queue_);
+			ret = clFinish(command_queue_);
+		}
+		for (auto queue : extra_queues_)
+		{
+			ret = clFinish(queue);
 		}
 
-		// Create a command queue
-		cl_command_queue command_queue = clCreateCommandQueueWithProperties(context, device_id, 0, &ret);
-		if (ret != CL_SUCCESS)
+		// The plans have to go before runtime_ tears clFFT down
+		submitted_.clear();
+		for (auto& entry : pipelines_)
 		{
-			clReleaseContext(context);
-			return {};
+			releasePipeline(*entry.second);
 		}
+		pipelines_.clear();
 
-		// Create memory buffers on the device for each vector
-		cl_mem mem_obj_input = clCreateBuffer(context, CL_MEM_READ_ONLY, sample_count * sizeof(std::complex<int16_t>), NULL, &ret);
-		cl_mem mem_obj_window = clCreateBuffer(context, CL_MEM_READ_ONLY, sample_count * sizeof(float), NULL, &ret);
-		cl_mem mem_obj_fft = clCreateBuffer(context, CL_MEM_READ_WRITE, sample_count * sizeof(std::complex<float>), NULL, &ret);
-		cl_mem signal_power_out = clCreateBuffer(context, CL_MEM_READ_WRITE, sample_count * sizeof(float), NULL, &ret);
+		releaseKernels();
 
-		// Create a program from the kernel source
-		char* source_str[] = { vectorMultiplicationCode.data() ,PostProcessCode.data() };
-		size_t source_size[] = { vectorMultiplicationCode.size()  , PostProcessCode.size() };
+		for (auto queue : extra_queues_)
+		{
+			ret = clReleaseCommandQueue(queue);
+		}
+		if (command_queue_ != nullptr) ret = clReleaseCommandQueue(command_queue_);
+		if (context_ != nullptr) ret = clReleaseContext(context_);
+	}
 
-		cl_program program = clCreateProgramWithSource(context, 2, (const char**)source_str, source_size, &ret);
-		if (ret != CL_SUCCESS)
+	void ModuleSignalProcessing::releaseEvents(FrameSlot& slot)
+	{
+		for (auto ev : { &slot.window_done_, &slot.fft_done_, &slot.postprocess_done_, &slot.display_done_, &slot.peaks_done_ })
 		{
-			ret = clReleaseMemObject(mem_obj_input);
-			ret = clReleaseMemObject(mem_obj_window);
-			ret = clReleaseMemObject(mem_obj_fft);
-			clReleaseCommandQueue(command_queue);
-			clReleaseContext(context);
-			return {};
+			if (*ev != nullptr)
+			{
+				clReleaseEvent(*ev);
+				*ev = nullptr;
+			}
 		}
-		// Build the program
-		ret = clBuildProgram(program, 1, &device_id, NULL, NULL, NULL);
-		if (ret != CL_SUCCESS)
+
+		for (auto events : { &slot.upload_done_, &slot.download_done_ })
+		{
+			for (auto ev : *events)
+			{
+				clReleaseEvent(ev);
+			}
+			events->clear();
+		}
+	}
+
+	auto ModuleSignalProcessing::mapHostMemory(size_t bytes, bool device_writes) ->std::shared_ptr<HostMapping>
+	{
+		// Runtimes only skip their staging copy for page aligned, cache line sized host memory
+		const size_t alloc_bytes = (bytes + 63) / 64 * 64;
+		void* raw = std::malloc(alloc_bytes + host_alignment_);
+		if (raw == nullptr)
 		{
-			clReleaseProgram(program);
-			clReleaseMemObject(mem_obj_input);
-			clReleaseMemObject(mem_obj_window);
-			clReleaseMemObject(mem_obj_fft);
-			clReleaseCommandQueue(command_queue);
-			clReleaseContext(context);
 			return {};
 		}
+		void* aligned = (void*)((uintptr_t(raw) + host_alignment_ - 1) / host_alignment_ * host_alignment_);
 
-		// Create the OpenCL kernel
-		cl_kernel kernel_preprocess = clCreateKernel(program, "vectorMultiplication", &ret);
+		cl_int ret;
+		auto mapping = std::make_shared<HostMapping>();
+		// Device outputs stay readable, OUTPUT_DISPLAY and OUTPUT_PEAKS read the dB spectrum back
+		mapping->mem_ = clCreateBuffer(context_, (device_writes ? CL_MEM_READ_WRITE : CL_MEM_READ_ONLY) | CL_MEM_USE_HOST_PTR, alloc_bytes, aligned, &ret);
 		if (ret != CL_SUCCESS)
 		{
-			ret = clReleaseKernel(kernel_preprocess);
-			ret = clReleaseProgram(program);
-			ret = clReleaseMemObject(mem_obj_input);
-			ret = clReleaseMemObject(mem_obj_window);
-			ret = clReleaseMemObject(mem_obj_fft);
-			clReleaseCommandQueue(command_queue);
-			clReleaseContext(context);
+			mapping->mem_ = nullptr;
+			std::free(raw);
 			return {};
 		}
 
-		// Create the OpenCL kernel
-		cl_kernel kernel_postprocess = clCreateKernel(program, "PostProcessCode", &ret);
+		ret = clSetMemObjectDestructorCallback(mapping->mem_, freeHostMemory, raw);
 		if (ret != CL_SUCCESS)
 		{
-			ret = clReleaseKernel(kernel_preprocess);
-			ret = clReleaseProgram(program);
-			ret = clReleaseMemObject(mem_obj_input);
-			ret = clReleaseMemObject(mem_obj_window);
-			ret = clReleaseMemObject(mem_obj_fft);
-			clReleaseCommandQueue(command_queue);
-			clReleaseContext(context);
+			// Nothing is enqueued on the buffer yet, so releasing it destroys it right away
+			clReleaseMemObject(mapping->mem_);
+			mapping->mem_ = nullptr;
+			std::free(raw);
 			return {};
 		}
 
-		/* Setup clFFT. */
-		clfftSetupData* fftSetup = new clfftSetupData;
-		ret = clfftInitSetupData(fftSetup);
-		ret = clfftSetup(fftSetup);
+		clRetainCommandQueue(command_queue_);
+		mapping->queue_ = command_queue_;
+		mapping->ptr_ = aligned;
+		mapping->bytes_ = bytes;
 
-		clfftPlanHandle planHandle;
-		clfftDim dim = CLFFT_1D;
-		size_t clLengths[1] = { sample_count };
-		/* Create a default plan for a complex FFT. */
-		ret = clfftCreateDefaultPlan(&planHandle, context, dim, clLengths);
+		return mapping;
+	}
 
-		/* Set plan parameters. */
-		ret = clfftSetPlanPrecision(planHandle, CLFFT_SINGLE);
-		ret = clfftSetLayout(planHandle, CLFFT_COMPLEX_INTERLEAVED, CLFFT_COMPLEX_INTERLEAVED);
-		ret = clfftSetResultLocation(planHandle, CLFFT_INPLACE);
+	auto ModuleSignalProcessing::reuseHostMemory(std::shared_ptr<HostMapping>& pooled, size_t bytes, cl_command_queue queue, std::vector<cl_event>& unmapped) ->std::shared_ptr<HostMapping>
+	{
+		// Spectra of the last round still point into the block, leave it to them and start a new one
+		if (!pooled || pooled.use_count() > 1 || pooled->bytes_ < bytes)
+		{
+			pooled = mapHostMemory(bytes, true);
+			return pooled;
+		}
 
-		/* Bake the plan. */
-		ret = clfftBakePlan(planHandle, 1, &command_queue, NULL, NULL);
+		if (pooled->mapped_)
+		{
+			cl_event done;
+			if (clEnqueueUnmapMemObject(queue, pooled->mem_, pooled->ptr_, 0, NULL, &done) != CL_SUCCESS)
+			{
+				pooled.reset();
+				return {};
+			}
+			pooled->mapped_ = false;
+			unmapped.push_back(done);
+		}
 
-		std::shared_ptr<ModuleSignalProcessing> obj = std::shared_ptr<ModuleSignalProcessing>(new ModuleSignalProcessing);
-		obj->context_ = context;
-		obj->command_queue_ = command_queue;
-		obj->program_ = program;
-		obj->kernel_preprocess_ = kernel_preprocess;
-		obj->kernel_postprocess_ = kernel_postprocess;
-		obj->mem_obj_input_ = mem_obj_input;
-		obj->mem_obj_window_ = mem_obj_window;
-		obj->mem_obj_fft_ = mem_obj_fft;
-		obj->signal_power_out_ = signal_power_out;
+		return pooled;
+	}
+
+	auto ModuleSignalProcessing::allocateInput(size_t sample_count) ->std::shared_ptr<AllignedBufferI16C>
+	{
+		if (sample_count == 0)
+		{
+			sample_count = sample_count_;
+		}
 
-		ret = clEnqueueWriteBuffer(obj->command_queue_, obj->mem_obj_window_, CL_TRUE, 0, sample_count * sizeof(float), window_vec.data(), 0, NULL, NULL);
+		if (!zero_copy_)
+		{
+			return std::make_shared<AllignedBufferI16C>(sample_count);
+		}
 
+		auto mapping = mapHostMemory(sample_count * sizeof(std::complex<int16_t>), false);
+		if (!mapping)
+		{
+			return std::make_shared<AllignedBufferI16C>(sample_count);
+		}
 
-		obj->fftSetup_ = fftSetup;
-		obj->planHandle_ = planHandle;
+		cl_int ret;
+		clEnqueueMapBuffer(command_queue_, mapping->mem_, CL_TRUE, CL_MAP_READ | CL_MAP_WRITE, 0, mapping->bytes_, 0, NULL, NULL, &ret);
+		if (ret != CL_SUCCESS)
+		{
+			return std::make_shared<AllignedBufferI16C>(sample_count);
+		}
+		mapping->mapped_ = true;
 
-		return obj;
+		{
+			std::lock_guard<std::mutex> lock(host_registry_->mutex_);
+			host_registry_->inputs_[mapping->ptr_] = mapping;
+		}
+
+		std::weak_ptr<HostRegistry> registry = host_registry_;
+		return std::make_shared<AllignedBufferI16C>(sample_count, (std::complex<int16_t>*)mapping->ptr_, [mapping, registry]()
+		{
+			if (auto reg = registry.lock())
+			{
+				std::lock_guard<std::mutex> lock(reg->mutex_);
+				reg->inputs_.erase(mapping->ptr_);
+			}
+		});
 	}
 
-	auto ModuleSignalProcessing::perform(const std::shared_ptr<AllignedBufferI16C>& rawData ) ->std::shared_ptr<AllignedBufferF>
+	auto ModuleSignalProcessing::ensureBuffer(cl_mem& mem, size_t bytes) ->bool
 	{
-		size_t sample_count = rawData->size();
+		if (mem != nullptr)
+		{
+			return true;
+		}
+
 		cl_int ret;
-		// Set the arguments of the kernel
+		mem = clCreateBuffer(context_, CL_MEM_READ_WRITE, bytes, NULL, &ret);
+		if (ret != CL_SUCCESS)
 		{
-			ret = clSetKernelArg(kernel_preprocess_, 0, sizeof(cl_mem), (void*)& mem_obj_input_);
-			ret = clSetKernelArg(kernel_preprocess_, 1, sizeof(cl_mem), (void*)& mem_obj_window_);
-			ret = clSetKernelArg(kernel_preprocess_, 2, sizeof(cl_mem), (void*)& mem_obj_fft_);
+			mem = nullptr;
+			return false;
+		}
 
-			// Copy the lists A and B to their respective memory buffers
-			ret = clEnqueueWriteBuffer(command_queue_, mem_obj_input_, CL_TRUE, 0, sample_count * sizeof(std::complex<int16_t>), rawData->data(), 0, NULL, NULL);
+		return true;
+	}
 
-			// Execute the OpenCL kernel on the list
-			size_t global_item_size = sample_count; // Process the entire lists
-			size_t local_item_size = 128; // Divide work items into groups of 64
-			ret = clEnqueueNDRangeKernel(command_queue_, kernel_preprocess_, 1, NULL, &global_item_size, &local_item_size, 0, NULL, NULL);
+	auto ModuleSignalProcessing::bakeFusedPlan(Pipeline& pipeline, FrameSlot& slot) ->bool
+	{
+		const std::string defines = "#define SAMPLE_COUNT " + std::to_string(pipeline.sample_count_) + "u\n";
+		const std::string load_code = defines + FusedWindowLoadCode;
+		const std::string store_code = defines + FusedDbStoreCode;
+
+		if (!ensureBuffer(slot.signal_power_out_, pipeline.sample_count_ * batch_ * sizeof(float)))
+		{
+			return false;
 		}
 
-		std::shared_ptr<AllignedBufferFC> retBufferf = std::make_shared<AllignedBufferFC>(sample_count);
+		cl_int ret;
+		size_t clLengths[1] = { pipeline.sample_count_ };
+		ret = clfftCreateDefaultPlan(&slot.fused_plan_, context_, CLFFT_1D, clLengths);
+		if (ret != CL_SUCCESS)
 		{
+			slot.fused_plan_ = 0;
+			return false;
+		}
 
-			//////////////////////////////////////////////////////////////////////////
-		/* Execute the plan. */
-			ret = clfftEnqueueTransform(planHandle_, CLFFT_FORWARD, 1, &command_queue_, 0, NULL, NULL, &mem_obj_fft_, NULL, NULL);
+		ret = clfftSetPlanPrecision(slot.fused_plan_, CLFFT_SINGLE);
+		ret = clfftSetLayout(slot.fused_plan_, CLFFT_COMPLEX_INTERLEAVED, CLFFT_COMPLEX_INTERLEAVED);
+		ret = clfftSetResultLocation(slot.fused_plan_, CLFFT_OUTOFPLACE);
+		ret = clfftSetPlanBatchSize(slot.fused_plan_, batch_);
+		ret = clfftSetPlanDistance(slot.fused_plan_, pipeline.sample_count_, pipeline.sample_count_);
 
-			ret = clEnqueueReadBuffer(command_queue_, mem_obj_fft_, CL_TRUE, 0, sample_count * sizeof(std::complex<float>), retBufferf->data(), 0, NULL, NULL);
+		ret = clfftSetPlanCallback(slot.fused_plan_, "fusedWindowLoad", load_code.c_str(), 0, PRECALLBACK, &pipeline.mem_obj_window_, 1);
+		if (ret == CL_SUCCESS)
+		{
+			ret = clfftSetPlanCallback(slot.fused_plan_, "fusedDbStore", store_code.c_str(), 0, POSTCALLBACK, &slot.signal_power_out_, 1);
+		}
+		if (ret == CL_SUCCESS)
+		{
+			ret = clfftBakePlan(slot.fused_plan_, 1, &command_queue_, NULL, NULL);
+		}
+		if (ret != CL_SUCCESS)
+		{
+			clfftDestroyPlan(&slot.fused_plan_);
+			slot.fused_plan_ = 0;
+			return false;
 		}
 
-		std::shared_ptr<AllignedBufferF> retBuffer = std::make_shared<AllignedBufferF>(sample_count);
+		return true;
+	}
 
-		//////////////////////////////////////////////////////////////////////////
+	void ModuleSignalProcessing::releasePipeline(Pipeline& pipeline)
+	{
+		for (auto& slot : pipeline.slots_)
 		{
-			ret = clSetKernelArg(kernel_postprocess_, 0, sizeof(cl_mem), (void*)& mem_obj_fft_);
-			ret = clSetKernelArg(kernel_postprocess_, 1, sizeof(cl_mem), (void*)& signal_power_out_);
-			// Execute the OpenCL kernel on the list
-			size_t global_item_size = sample_count/2; // Process the entire lists
-			size_t local_item_size = 128; // Divide work items into groups of 64
-			ret = clEnqueueNDRangeKernel(command_queue_, kernel_postprocess_, 1, NULL, &global_item_size, &local_item_size, 0, NULL, NULL);
+			releaseEvents(slot);
+			if (slot.fused_plan_ != 0) clfftDestroyPlan(&slot.fused_plan_);
+			if (slot.mem_obj_input_ != nullptr) clReleaseMemObject(slot.mem_obj_input_);
+			if (slot.mem_obj_fft_ != nullptr) clReleaseMemObject(slot.mem_obj_fft_);
+			if (slot.signal_linear_out_ != nullptr) clReleaseMemObject(slot.signal_linear_out_);
+			if (slot.signal_power_out_ != nullptr) clReleaseMemObject(slot.signal_power_out_);
+			if (slot.packed_out_ != nullptr) clReleaseMemObject(slot.packed_out_);
+			if (slot.display_out_ != nullptr) clReleaseMemObject(slot.display_out_);
+			for (auto mem : { slot.peak_bins_, slot.peak_db_, slot.peak_counts_, slot.peaks_out_ })
+			{
+				if (mem != nullptr) clReleaseMemObject(mem);
+			}
+			if (slot.tmp_buffer_ != nullptr) clReleaseMemObject(slot.tmp_buffer_);
+		}
+		pipeline.slots_.clear();
 
-			ret = clEnqueueReadBuffer(command_queue_, signal_power_out_, CL_TRUE, 0, sample_count * sizeof(float), retBuffer->data(), 0, NULL, NULL);
+		releaseAveraging(pipeline);
+		for (auto mem : pipeline.stream_buffers_)
+		{
+			if (mem != nullptr) clReleaseMemObject(mem);
 		}
+		if (pipeline.traces_done_ != nullptr) clReleaseEvent(pipeline.traces_done_);
+		if (pipeline.traces_ != nullptr) clReleaseMemObject(pipeline.traces_);
+		pipeline.traces_done_ = nullptr;
+		pipeline.traces_ = nullptr;
+		if (pipeline.planHandle_ != 0) clfftDestroyPlan(&pipeline.planHandle_);
+		if (pipeline.mem_obj_window_ != nullptr) clReleaseMemObject(pipeline.mem_obj_window_);
+		pipeline.planHandle_ = 0;
+		pipeline.mem_obj_window_ = nullptr;
+	}
 
+	auto ModuleSignalProcessing::buildPipeline(size_t sample_count, const WindowFunction::win_type win_type) ->std::unique_ptr<Pipeline>
+	{
+		if (!isSmoothPointCount(sample_count))
+		{
+			return {};
+		}
 
-		ret = clFlush(command_queue_);
-		ret = clFinish(command_queue_);
+		auto window_vec = WindowFunction::build(win_type, int(sample_count), 0);
+		for (int i = 0; i < int(sample_count); ++i)
+		{
+			window_vec[i] = window_vec[i] / 32768.0f;
+		}
 
-		return retBuffer;
+		cl_int ret;
+		auto pipeline = std::make_unique<Pipeline>();
+		pipeline->sample_count_ = sample_count;
+
+		// The vector kernels cover WIDTH bins of each half frame per work-item
+		const bool vectorized = vector_width_ > 1 && sample_count % (2 * vector_width_) == 0;
+		pipeline->preprocess_ = vectorized ? kernel_preprocess_vec_ : kernel_preprocess_;
+		pipeline->postprocess_ = vectorized ? kernel_postprocess_vec_ : kernel_postprocess_;
+		pipeline->width_ = vectorized ? vector_width_ : 1;
+		pipeline->items_preprocess_ = cl_int(sample_count / pipeline->width_);
+		pipeline->items_postprocess_ = cl_int(vectorized ? sample_count / 2 / vector_width_ : sample_count);
+
+		// Device buffers hold a whole batch of frames back to back
+		const size_t batch_count = sample_count * batch_;
+
+		// One buffer set per in-flight frame, the window is shared by all of them.
+		// The power and dB buffers are created by submitBatch() once their stage is selected.
+		pipeline->mem_obj_window_ = clCreateBuffer(context_, CL_MEM_READ_ONLY, sample_count * sizeof(float), NULL, &ret);
+		if (ret != CL_SUCCESS)
+		{
+			pipeline->mem_obj_window_ = nullptr;
+			return {};
+		}
+
+		pipeline->slots_.resize(max_in_flight_);
+		for (auto& slot : pipeline->slots_)
+		{
+			// clFFT sizes its out-of-place input by the float2 plan layout, so fused mode gets the larger buffer
+			const size_t input_sample_bytes = fused_requested_ ? sizeof(std::complex<float>) : sizeof(std::complex<int16_t>);
+			slot.mem_obj_input_ = clCreateBuffer(context_, CL_MEM_READ_ONLY, batch_count * input_sample_bytes, NULL, &ret);
+			if (ret != CL_SUCCESS)
+			{
+				slot.mem_obj_input_ = nullptr;
+				releasePipeline(*pipeline);
+				return {};
+			}
+			slot.mem_obj_fft_ = clCreateBuffer(context_, CL_MEM_READ_WRITE, batch_count * sizeof(std::complex<float>), NULL, &ret);
+			if (ret != CL_SUCCESS)
+			{
+				slot.mem_obj_fft_ = nullptr;
+				releasePipeline(*pipeline);
+				return {};
+			}
+		}
+
+		clfftDim dim = CLFFT_1D;
+		size_t clLengths[1] = { sample_count };
+		/* Create a default plan for a complex FFT. */
+		ret = clfftCreateDefaultPlan(&pipeline->planHandle_, context_, dim, clLengths);
+		if (ret != CL_SUCCESS)
+		{
+			pipeline->planHandle_ = 0;
+			releasePipeline(*pipeline);
+			return {};
+		}
+
+		/* Set plan parameters. */
+		ret = clfftSetPlanPrecision(pipeline->planHandle_, CLFFT_SINGLE);
+		ret = clfftSetLayout(pipeline->planHandle_, CLFFT_COMPLEX_INTERLEAVED, CLFFT_COMPLEX_INTERLEAVED);
+		ret = clfftSetResultLocation(pipeline->planHandle_, CLFFT_INPLACE);
+		ret = clfftSetPlanBatchSize(pipeline->planHandle_, batch_);
+		ret = clfftSetPlanDistance(pipeline->planHandle_, sample_count, sample_count);
+
+		/* Bake the plan. */
+		ret = clfftBakePlan(pipeline->planHandle_, 1, &command_queue_, NULL, NULL);
+		if (ret != CL_SUCCESS)
+		{
+			releasePipeline(*pipeline);
+			return {};
+		}
+
+		ret = clEnqueueWriteBuffer(command_queue_, pipeline->mem_obj_window_, CL_TRUE, 0, sample_count * sizeof(float), window_vec.data(), 0, NULL, NULL);
+		if (ret != CL_SUCCESS)
+		{
+			releasePipeline(*pipeline);
+			return {};
+		}
+
+		// Time the kernels on this pipeline's buffers, or reuse what an earlier run measured
+		{
+			auto& slot = pipeline->slots_.front();
+			if (!ensureBuffer(slot.signal_power_out_, batch_count * sizeof(float)))
+			{
+				releasePipeline(*pipeline);
+				return {};
+			}
+
+			ret = clSetKernelArg(pipeline->preprocess_, 0, sizeof(cl_mem), (void*)& slot.mem_obj_input_);
+			ret = clSetKernelArg(pipeline->preprocess_, 1, sizeof(cl_mem), (void*)& pipeline->mem_obj_window_);
+			ret = clSetKernelArg(pipeline->preprocess_, 2, sizeof(cl_mem), (void*)& slot.mem_obj_fft_);
+			ret = clSetKernelArg(pipeline->preprocess_, 3, sizeof(cl_int), (void*)& pipeline->items_preprocess_);
+			const cl_int stride = cl_int(sample_count);
+			ret = clSetKernelArg(pipeline->preprocess_, 4, sizeof(cl_int), (void*)& stride);
+			size_t preprocess_size[] = { size_t(pipeline->items_preprocess_), batch_ };
+			pipeline->local_preprocess_ = runtime_->tuner().tune(command_queue_, pipeline->preprocess_, preprocess_size);
+
+			ret = clSetKernelArg(pipeline->postprocess_, 0, sizeof(cl_mem), (void*)& slot.mem_obj_fft_);
+			ret = clSetKernelArg(pipeline->postprocess_, 1, sizeof(cl_mem), NULL);
+			ret = clSetKernelArg(pipeline->postprocess_, 2, sizeof(cl_mem), (void*)& slot.signal_power_out_);
+			ret = clSetKernelArg(pipeline->postprocess_, 3, sizeof(cl_int), (void*)& pipeline->items_postprocess_);
+			const cl_int no_traces = 0;
+			const float no_decay = 0.0f;
+			ret = clSetKernelArg(pipeline->postprocess_, 4, sizeof(cl_mem), NULL);
+			ret = clSetKernelArg(pipeline->postprocess_, 5, sizeof(cl_int), (void*)& no_traces);
+			ret = clSetKernelArg(pipeline->postprocess_, 6, sizeof(float), (void*)& no_decay);
+			ret = clSetKernelArg(pipeline->postprocess_, 7, sizeof(cl_int), (void*)& no_traces);
+			ret = clSetKernelArg(pipeline->postprocess_, 8, sizeof(cl_mem), NULL);
+			ret = clSetKernelArg(pipeline->postprocess_, 9, sizeof(cl_mem), NULL);
+			size_t postprocess_size[] = { size_t(pipeline->items_postprocess_), batch_ };
+			pipeline->local_postprocess_ = runtime_->tuner().tune(command_queue_, pipeline->postprocess_, postprocess_size);
+		}
+
+		if (fused_requested_)
+		{
+			// All or nothing, a failed bake keeps the three kernel path
+			pipeline->fused_ = true;
+			for (auto& slot : pipeline->slots_)
+			{
+				pipeline->fused_ = pipeline->fused_ && bakeFusedPlan(*pipeline, slot);
+			}
+			if (!pipeline->fused_)
+			{
+				for (auto& slot : pipeline->slots_)
+				{
+					if (slot.fused_plan_ != 0) clfftDestroyPlan(&slot.fused_plan_);
+				}
+			}
+		}
+
+		// clFFT would share one scratch buffer of the plan between all queues, give every slot its own
+		size_t tmp_size = 0;
+		clfftGetTmpBufSize(pipeline->planHandle_, &tmp_size);
+		for (auto& slot : pipeline->slots_)
+		{
+			size_t slot_tmp_size = tmp_size;
+			size_t fused_tmp_size = 0;
+			if (slot.fused_plan_ != 0 && clfftGetTmpBufSize(slot.fused_plan_, &fused_tmp_size) == CLFFT_SUCCESS)
+			{
+				slot_tmp_size = std::max(slot_tmp_size, fused_tmp_size);
+			}
+
+			if (slot_tmp_size > 0 && !ensureBuffer(slot.tmp_buffer_, slot_tmp_size))
+			{
+				releasePipeline(*pipeline);
+				return {};
+			}
+		}
+
+		return pipeline;
+	}
+
+	auto ModuleSignalProcessing::findPipeline(size_t sample_count) ->Pipeline*
+	{
+		const auto key = std::make_pair(sample_count, win_type_);
+		auto it = pipelines_.find(key);
+		if (it != pipelines_.end())
+		{
+			return it->second.get();
+		}
+
+		auto pipeline = buildPipeline(sample_count, win_type_);
+		if (!pipeline)
+		{
+			return nullptr;
+		}
+
+		return (pipelines_[key] = std::move(pipeline)).get();
+	}
+
+	auto ModuleSignalProcessing::prepare(size_t sample_count) ->bool
+	{
+		return findPipeline(sample_count) != nullptr;
+	}
+
+	bool ModuleSignalProcessing::fused() const
+	{
+		auto it = pipelines_.find(std::make_pair(sample_count_, win_type_));
+		return it != pipelines_.end() && it->second->fused_;
+	}
+
+	void ModuleSignalProcessing::releaseAveraging(Pipeline& pipeline)
+	{
+		if (pipeline.welch_plan_ != 0) clfftDestroyPlan(&pipeline.welch_plan_);
+		for (auto mem : { &pipeline.welch_history_, &pipeline.welch_segments_, &pipeline.welch_accumulator_ })
+		{
+			if (*mem != nullptr)
+			{
+				clReleaseMemObject(*mem);
+				*mem = nullptr;
+			}
+		}
+		pipeline.welch_plan_ = 0;
+		pipeline.welch_segment_count_ = 0;
+	}
+
+	auto ModuleSignalProcessing::prepareAveraging(Pipeline& pipeline) ->bool
+	{
+		// 1 - 1/k overlap gives k segments per frame, hop samples apart
+		const size_t segment_count = size_t(std::lround(1.0 / (1.0 - double(averaging_.overlap))));
+		// Segments start hop = sample_count / segment_count samples apart, a remainder would shift them
+		if (pipeline.sample_count_ % segment_count != 0)
+		{
+			return false;
+		}
+		if (pipeline.welch_plan_ != 0 && pipeline.welch_segment_count_ == segment_count)
+		{
+			return true;
+		}
+
+		releaseAveraging(pipeline);
+		pipeline.welch_primed_ = false;
+		pipeline.welch_reset_ = true;
+		pipeline.welch_frames_ = 0;
+		pipeline.welch_accumulated_ = 0;
+
+		const size_t sample_count = pipeline.sample_count_;
+		if (!ensureBuffer(pipeline.welch_history_, 2 * sample_count * sizeof(std::complex<int16_t>))
+			|| !ensureBuffer(pipeline.welch_segments_, segment_count * sample_count * sizeof(std::complex<float>))
+			|| !ensureBuffer(pipeline.welch_accumulator_, sample_count * sizeof(float)))
+		{
+			releaseAveraging(pipeline);
+			return false;
+		}
+
+		cl_int ret;
+		size_t clLengths[1] = { sample_count };
+		ret = clfftCreateDefaultPlan(&pipeline.welch_plan_, context_, CLFFT_1D, clLengths);
+		if (ret != CL_SUCCESS)
+		{
+			pipeline.welch_plan_ = 0;
+			releaseAveraging(pipeline);
+			return false;
+		}
+
+		ret = clfftSetPlanPrecision(pipeline.welch_plan_, CLFFT_SINGLE);
+		ret = clfftSetLayout(pipeline.welch_plan_, CLFFT_COMPLEX_INTERLEAVED, CLFFT_COMPLEX_INTERLEAVED);
+		ret = clfftSetResultLocation(pipeline.welch_plan_, CLFFT_INPLACE);
+		ret = clfftSetPlanBatchSize(pipeline.welch_plan_, segment_count);
+		ret = clfftSetPlanDistance(pipeline.welch_plan_, sample_count, sample_count);
+
+		ret = clfftBakePlan(pipeline.welch_plan_, 1, &command_queue_, NULL, NULL);
+		if (ret != CL_SUCCESS)
+		{
+			releaseAveraging(pipeline);
+			return false;
+		}
+
+		pipeline.welch_segment_count_ = segment_count;
+
+		return true;
+	}
+
+	void ModuleSignalProcessing::setAveraging(const AveragingOptions& averaging)
+	{
+		averaging_ = averaging;
+		averaging_.frames = std::max<size_t>(averaging_.frames, 1);
+		averaging_.overlap = std::min(std::max(averaging_.overlap, 0.0f), 0.99f);
+
+		for (auto& entry : pipelines_)
+		{
+			auto& pipeline = *entry.second;
+			pipeline.welch_primed_ = false;
+			pipeline.welch_reset_ = true;
+			pipeline.welch_frames_ = 0;
+			pipeline.welch_accumulated_ = 0;
+		}
+	}
+
+	auto ModuleSignalProcessing::submitAveraging(Pipeline& pipeline, FrameSlot& slot, const std::vector<std::shared_ptr<AllignedBufferI16C>>& frames) ->bool
+	{
+		if (!prepareAveraging(pipeline))
+		{
+			return false;
+		}
+
+		// Averages are always reported as float, whatever the dB format
+		if ((outputs_ & OUTPUT_POWER) && !ensureBuffer(slot.signal_linear_out_, pipeline.sample_count_ * batch_ * sizeof(float)))
+		{
+			return false;
+		}
+		if ((outputs_ & OUTPUT_DB) && !ensureBuffer(slot.signal_power_out_, pipeline.sample_count_ * batch_ * sizeof(float)))
+		{
+			return false;
+		}
+
+		const size_t sample_count = pipeline.sample_count_;
+		const size_t frame_bytes = sample_count * sizeof(std::complex<int16_t>);
+		const cl_int count = cl_int(sample_count);
+		const cl_int segment_count = cl_int(pipeline.welch_segment_count_);
+		const cl_int hop = cl_int(sample_count / pipeline.welch_segment_count_);
+		const cl_int exponential = averaging_.mode == AVERAGING_EXPONENTIAL ? 1 : 0;
+		const unsigned outputs = outputs_;
+
+		// Every command reads or writes the accumulator, so all of them go through the first queue in order
+		cl_command_queue queue = command_queue_;
+
+		// Only the last command of each stage is kept, the queue orders the rest
+		auto keep = [](cl_event& kept, cl_event next)
+		{
+			if (kept != nullptr) clReleaseEvent(kept);
+			kept = next;
+		};
+
+		// The first failing call stops the submission. What is already queued still reads the frames and
+		// writes the spectra, so it is waited for; the history and the accumulator hold part of the
+		// submission at that point and the averages start over.
+		bool ok = true;
+		auto check = [&ok](cl_int result)
+		{
+			ok = ok && result == CL_SUCCESS;
+			return ok;
+		};
+		auto fail = [&]() ->bool
+		{
+			clFinish(queue);
+			releaseEvents(slot);
+			slot.input_.clear();
+			slot.result_.clear();
+			pipeline.welch_primed_ = false;
+			pipeline.welch_reset_ = true;
+			pipeline.welch_frames_ = 0;
+			pipeline.welch_accumulated_ = 0;
+			return false;
+		};
+
+		slot.input_ = frames;
+		slot.result_.clear();
+
+		for (const auto& rawData : frames)
+		{
+			// The previous frame moves to the front of the history, the new one goes behind it
+			if (pipeline.welch_primed_)
+			{
+				cl_event moved;
+				if (!check(clEnqueueCopyBuffer(queue, pipeline.welch_history_, pipeline.welch_history_, frame_bytes, 0, frame_bytes, 0, NULL, &moved)))
+				{
+					return fail();
+				}
+				slot.upload_done_.push_back(moved);
+			}
+			cl_event written;
+			if (!check(clEnqueueWriteBuffer(queue, pipeline.welch_history_, CL_FALSE, frame_bytes, frame_bytes, rawData->data(), 0, NULL, &written)))
+			{
+				return fail();
+			}
+			slot.upload_done_.push_back(written);
+
+			// Without a previous frame only the newest segment is complete
+			const cl_int first = pipeline.welch_primed_ ? 0 : segment_count - 1;
+
+			cl_event windowed;
+			check(clSetKernelArg(kernel_welch_segments_, 0, sizeof(cl_mem), (void*)& pipeline.welch_history_));
+			check(clSetKernelArg(kernel_welch_segments_, 1, sizeof(cl_mem), (void*)& pipeline.mem_obj_window_));
+			check(clSetKernelArg(kernel_welch_segments_, 2, sizeof(cl_mem), (void*)& pipeline.welch_segments_));
+			check(clSetKernelArg(kernel_welch_segments_, 3, sizeof(cl_int), (void*)& count));
+			check(clSetKernelArg(kernel_welch_segments_, 4, sizeof(cl_int), (void*)& hop));
+			check(clSetKernelArg(kernel_welch_segments_, 5, sizeof(cl_int), (void*)& segment_count));
+			check(clSetKernelArg(kernel_welch_segments_, 6, sizeof(cl_int), (void*)& first));
+			size_t segments_size[] = { sample_count, size_t(segment_count - first) };
+			if (!ok || !check(clEnqueueNDRangeKernel(queue, kernel_welch_segments_, 2, NULL, segments_size, NULL, 0, NULL, &windowed)))
+			{
+				return fail();
+			}
+			keep(slot.window_done_, windowed);
+
+			cl_event transformed;
+			if (!check(clfftEnqueueTransform(pipeline.welch_plan_, CLFFT_FORWARD, 1, &queue, 0, NULL, &transformed, &pipeline.welch_segments_, NULL, NULL)))
+			{
+				return fail();
+			}
+			keep(slot.fft_done_, transformed);
+
+			const cl_int reset = pipeline.welch_reset_ ? 1 : 0;
+			cl_event accumulated;
+			check(clSetKernelArg(kernel_welch_accumulate_, 0, sizeof(cl_mem), (void*)& pipeline.welch_segments_));
+			check(clSetKernelArg(kernel_welch_accumulate_, 1, sizeof(cl_mem), (void*)& pipeline.welch_accumulator_));
+			check(clSetKernelArg(kernel_welch_accumulate_, 2, sizeof(cl_int), (void*)& count));
+			check(clSetKernelArg(kernel_welch_accumulate_, 3, sizeof(cl_int), (void*)& first));
+			check(clSetKernelArg(kernel_welch_accumulate_, 4, sizeof(cl_int), (void*)& segment_count));
+			check(clSetKernelArg(kernel_welch_accumulate_, 5, sizeof(cl_int), (void*)& exponential));
+			check(clSetKernelArg(kernel_welch_accumulate_, 6, sizeof(float), (void*)& averaging_.alpha));
+			check(clSetKernelArg(kernel_welch_accumulate_, 7, sizeof(cl_int), (void*)& reset));
+			size_t accumulate_size[] = { sample_count };
+			if (!ok || !check(clEnqueueNDRangeKernel(queue, kernel_welch_accumulate_, 1, NULL, accumulate_size, NULL, 0, NULL, &accumulated)))
+			{
+				return fail();
+			}
+			keep(slot.postprocess_done_, accumulated);
+
+			pipeline.welch_primed_ = true;
+			pipeline.welch_reset_ = false;
+			pipeline.welch_accumulated_ += size_t(segment_count - first);
+			if (++pipeline.welch_frames_ < averaging_.frames)
+			{
+				continue;
+			}
+
+			// Report: scale, fftshift and convert the accumulator once, then download it
+			const float scale = exponential ? 1.0f : 1.0f / float(pipeline.welch_accumulated_);
+			cl_mem power_out = (outputs & OUTPUT_POWER) ? slot.signal_linear_out_ : nullptr;
+			cl_mem db_out = (outputs & OUTPUT_DB) ? slot.signal_power_out_ : nullptr;
+
+			cl_event converted;
+			check(clSetKernelArg(kernel_welch_output_, 0, sizeof(cl_mem), (void*)& pipeline.welch_accumulator_));
+			check(clSetKernelArg(kernel_welch_output_, 1, sizeof(cl_mem), power_out ? (void*)& power_out : NULL));
+			check(clSetKernelArg(kernel_welch_output_, 2, sizeof(cl_mem), db_out ? (void*)& db_out : NULL));
+			check(clSetKernelArg(kernel_welch_output_, 3, sizeof(cl_int), (void*)& count));
+			check(clSetKernelArg(kernel_welch_output_, 4, sizeof(float), (void*)& scale));
+			if (!ok || !check(clEnqueueNDRangeKernel(queue, kernel_welch_output_, 1, NULL, accumulate_size, NULL, 0, NULL, &converted)))
+			{
+				return fail();
+			}
+			keep(slot.postprocess_done_, converted);
+
+			Spectrum spectrum;
+			for (auto stage : { std::make_pair(power_out, &Spectrum::power), std::make_pair(db_out, &Spectrum::db) })
+			{
+				if (stage.first == nullptr)
+				{
+					continue;
+				}
+
+				spectrum.*stage.second = std::make_shared<AllignedBufferF>(sample_count);
+				cl_event done;
+				if (!check(clEnqueueReadBuffer(queue, stage.first, CL_FALSE, 0, sample_count * sizeof(float), (spectrum.*stage.second)->data(), 1, &slot.postprocess_done_, &done)))
+				{
+					return fail();
+				}
+				slot.download_done_.push_back(done);
+			}
+			slot.result_.push_back(spectrum);
+
+			pipeline.welch_frames_ = 0;
+			if (!exponential)
+			{
+				pipeline.welch_reset_ = true;
+				pipeline.welch_accumulated_ = 0;
+			}
+		}
+
+		// Kick the device, but do not wait for it
+		if (!check(clFlush(queue)))
+		{
+			return fail();
+		}
+
+		return true;
+	}
+
+	void ModuleSignalProcessing::setDisplay(const DisplayOptions& display)
+	{
+		display_ = display;
+		display_.bins = std::max<size_t>(display_.bins, 1);
+
+		// The display buffers are sized for the old bucket count, in-flight kernels keep theirs alive
+		for (auto& entry : pipelines_)
+		{
+			for (auto& slot : entry.second->slots_)
+			{
+				if (slot.display_out_ != nullptr)
+				{
+					clReleaseMemObject(slot.display_out_);
+					slot.display_out_ = nullptr;
+				}
+			}
+		}
+	}
+
+	void ModuleSignalProcessing::setPeaks(const PeakOptions& peaks)
+	{
+		peaks_ = peaks;
+		peaks_.count = std::max<size_t>(peaks_.count, 1);
+
+		// Same as setDisplay(), the peak lists are sized for the old count
+		for (auto& entry : pipelines_)
+		{
+			for (auto& slot : entry.second->slots_)
+			{
+				if (slot.peaks_out_ != nullptr)
+				{
+					clReleaseMemObject(slot.peaks_out_);
+					slot.peaks_out_ = nullptr;
+				}
+			}
+		}
+	}
+
+	void ModuleSignalProcessing::setTraces(unsigned traces)
+	{
+		traces_ = traces & (TRACE_MAX_HOLD | TRACE_MIN_HOLD | TRACE_PERSISTENCE);
+		resetTraces();
+	}
+
+	void ModuleSignalProcessing::resetTraces()
+	{
+		// traces_done_ stays, the next update still has to follow the previous one
+		for (auto& entry : pipelines_)
+		{
+			entry.second->traces_reset_ = true;
+		}
+	}
+
+	auto ModuleSignalProcessing::readTrace(trace_type trace, size_t sample_count) ->std::shared_ptr<AllignedBufferF>
+	{
+		if (sample_count == 0)
+		{
+			sample_count = sample_count_;
+		}
+
+		auto it = pipelines_.find(std::make_pair(sample_count, win_type_));
+		if ((traces_ & trace) == 0 || it == pipelines_.end() || it->second->traces_reset_ || it->second->traces_done_ == nullptr)
+		{
+			return {};
+		}
+
+		const size_t index = trace == TRACE_MAX_HOLD ? 0 : trace == TRACE_MIN_HOLD ? 1 : 2;
+		const size_t trace_bytes = sample_count * sizeof(float);
+		auto retBuffer = std::make_shared<AllignedBufferF>(sample_count);
+		cl_int ret = clEnqueueReadBuffer(command_queue_, it->second->traces_, CL_TRUE, index * trace_bytes, trace_bytes, retBuffer->data(), 1, &it->second->traces_done_, NULL);
+		if (ret != CL_SUCCESS)
+		{
+			return {};
+		}
+
+		return retBuffer;
+	}
+
+	void ModuleSignalProcessing::releaseKernels()
+	{
+		for (auto kernel : { &kernel_preprocess_, &kernel_postprocess_, &kernel_preprocess_vec_, &kernel_postprocess_vec_, &kernel_welch_segments_, &kernel_welch_accumulate_, &kernel_welch_output_, &kernel_display_, &kernel_peak_candidates_, &kernel_peak_topk_ })
+		{
+			if (*kernel != nullptr)
+			{
+				clReleaseKernel(*kernel);
+				*kernel = nullptr;
+			}
+		}
+	}
+
+	auto ModuleSignalProcessing::createKernels(bool fast_math) ->bool
+	{
+		const std::string precise_options = "-D WIDTH=" + std::to_string(vector_width_ > 1 ? vector_width_ : 4);
+		std::string build_options = precise_options;
+		if (fast_math)
+		{
+			build_options += " -cl-fast-relaxed-math -D LOG10=native_log10";
+		}
+
+		// The programs are compiled once per runtime; kernels carry their arguments, so each module has its own.
+		// checkAccuracy() only covers the per-frame dB spectrum, averaging, display and peaks always run precise.
+		cl_program program = runtime_->program({ KernelConfigCode, vectorMultiplicationCode, PostProcessCode, VectorKernelCode }, build_options);
+		cl_program precise_program = runtime_->program({ KernelConfigCode, WelchCode, DisplayCode, PeakCode }, precise_options);
+		if (program == nullptr || precise_program == nullptr)
+		{
+			return false;
+		}
+
+		std::vector<std::pair<cl_kernel*, const char*>> kernels = {
+			{ &kernel_preprocess_, "vectorMultiplication" },
+			{ &kernel_postprocess_, "PostProcessCode" },
+		};
+		if (vector_width_ > 1)
+		{
+			kernels.push_back({ &kernel_preprocess_vec_, "vectorMultiplicationVec" });
+			kernels.push_back({ &kernel_postprocess_vec_, "PostProcessVec" });
+		}
+		const std::vector<std::pair<cl_kernel*, const char*>> precise_kernels = {
+			{ &kernel_welch_segments_, "WelchSegments" },
+			{ &kernel_welch_accumulate_, "WelchAccumulate" },
+			{ &kernel_welch_output_, "WelchOutput" },
+			{ &kernel_display_, "DecimateDb" },
+			{ &kernel_peak_candidates_, "PeakCandidates" },
+			{ &kernel_peak_topk_, "PeakTopK" },
+		};
+
+		cl_int ret;
+		for (auto& kernel : kernels)
+		{
+			// Create the OpenCL kernel
+			*kernel.first = clCreateKernel(program, kernel.second, &ret);
+			if (ret != CL_SUCCESS)
+			{
+				*kernel.first = nullptr;
+				releaseKernels();
+				return false;
+			}
+		}
+		for (auto& kernel : precise_kernels)
+		{
+			*kernel.first = clCreateKernel(precise_program, kernel.second, &ret);
+			if (ret != CL_SUCCESS)
+			{
+				*kernel.first = nullptr;
+				releaseKernels();
+				return false;
+			}
+		}
+
+		// The top-K reduction halves its work-group, so it runs on the largest power of two that fits
+		size_t peak_group = 1;
+		clGetKernelWorkGroupInfo(kernel_peak_topk_, runtime_->device(), CL_KERNEL_WORK_GROUP_SIZE, sizeof(size_t), &peak_group, NULL);
+		peak_local_ = 1;
+		while (peak_local_ * 2 <= std::min<size_t>(peak_group, 256))
+		{
+			peak_local_ *= 2;
+		}
+
+		fast_math_ = fast_math;
+
+		return true;
+	}
+
+	auto ModuleSignalProcessing::checkAccuracy(float tolerance_db) ->bool
+	{
+		// A tone over full band noise, so the spectrum spans a wide range of powers
+		auto frame = std::make_shared<AllignedBufferI16C>(sample_count_);
+		std::minstd_rand gen(12345);
+		std::uniform_int_distribution<int> noise(-1024, 1024);
+		for (size_t index = 0; index < sample_count_; ++index)
+		{
+			const double phase = 2.0 * 3.14159265358979 * 0.1234 * double(index);
+			frame->set(index, std::complex<int16_t>(int16_t(16000.0 * std::cos(phase) + noise(gen)), int16_t(16000.0 * std::sin(phase) + noise(gen))));
+		}
+
+		// Anything but exactly OUTPUT_DB, so a fused pipeline runs the kernels under test as well
+		const unsigned outputs = outputs_;
+		const output_format db_format = db_format_;
+		outputs_ = OUTPUT_POWER | OUTPUT_DB;
+		db_format_ = FORMAT_FLOAT32;
+		const bool submitted = submit(frame);
+		auto spectra = submitted ? waitSpectra() : std::vector<Spectrum>{};
+		outputs_ = outputs;
+		db_format_ = db_format;
+
+		if (spectra.empty() || !spectra.front().db)
+		{
+			return false;
+		}
+
+		FFTCpu cpu(FFTPointCount(sample_count_), win_type_);
+		cpu.setDbPrecision(simd::DB_EXACT);
+		auto reference = cpu.forward(frame);
+		const auto& db = spectra.front().db;
+
+		float peak = reference->get(0);
+		for (size_t bin = 1; bin < sample_count_; ++bin)
+		{
+			peak = std::max(peak, reference->get(bin));
+		}
+
+		// Bins far below the peak are dominated by the two FFT implementations, not by the dB conversion
+		for (size_t bin = 0; bin < sample_count_; ++bin)
+		{
+			const float expected = reference->get(bin);
+			if (expected > peak - 100.0f && std::abs(db->get(bin) - expected) > tolerance_db)
+			{
+				return false;
+			}
+		}
+
+		return true;
+	}
+
+	auto ModuleSignalProcessing::create(size_t sample_count, const WindowFunction::win_type win_type, const ProcessingOptions& options) ->std::shared_ptr<ModuleSignalProcessing>
+	{
+		RuntimeOptions runtime_options;
+		runtime_options.program_cache = options.program_cache;
+		runtime_options.cache_directory = options.cache_directory;
+
+		auto runtime = Runtime::create(runtime_options);
+		if (!runtime)
+		{
+			return {};
+		}
+
+		return create(runtime, sample_count, win_type, options);
+	}
+
+	auto ModuleSignalProcessing::create(const std::shared_ptr<Runtime>& runtime, size_t sample_count, const WindowFunction::win_type win_type, const ProcessingOptions& options) ->std::shared_ptr<ModuleSignalProcessing>
+	{
+		if (!runtime || options.in_flight == 0 || options.batch == 0 || options.queues == 0)
+		{
+			return {};
+		}
+
+		auto device_id = runtime->device();
+
+		cl_int ret;
+
+		// Everything created below is owned by obj, so an early return releases it in the destructor.
+		std::shared_ptr<ModuleSignalProcessing> obj = std::shared_ptr<ModuleSignalProcessing>(new ModuleSignalProcessing);
+		obj->runtime_ = runtime;
+		obj->sample_count_ = sample_count;
+		obj->win_type_ = win_type;
+		obj->max_in_flight_ = options.in_flight;
+		obj->batch_ = options.batch;
+		obj->outputs_ = options.outputs;
+		obj->db_format_ = options.db_format;
+		obj->stream_hop_ = options.stream_hop;
+		obj->fused_requested_ = options.fused;
+		obj->setDisplay(options.display);
+		obj->setPeaks(options.peaks);
+		obj->persistence_decay_db_ = options.persistence_decay_db;
+		obj->host_registry_ = std::make_shared<HostRegistry>();
+		if (options.profiling)
+		{
+			obj->profiler_ = std::make_unique<StageProfiler>(options.profiling_window);
+		}
+
+		cl_bool unified_memory = CL_FALSE;
+		clGetDeviceInfo(device_id, CL_DEVICE_HOST_UNIFIED_MEMORY, sizeof(cl_bool), &unified_memory, NULL);
+		obj->zero_copy_ = options.memory == HOST_MEMORY_ZERO_COPY || (options.memory == HOST_MEMORY_AUTO && unified_memory == CL_TRUE);
+
+		cl_uint base_align_bits = 0;
+		clGetDeviceInfo(device_id, CL_DEVICE_MEM_BASE_ADDR_ALIGN, sizeof(cl_uint), &base_align_bits, NULL);
+		obj->host_alignment_ = std::max<size_t>(4096, base_align_bits / 8);
+
+		clRetainContext(runtime->context());
+		obj->context_ = runtime->context();
+
+		// Every stream gets its own queue, so the channels do not serialise behind each other
+		cl_queue_properties queue_properties[] = { CL_QUEUE_PROPERTIES, CL_QUEUE_PROFILING_ENABLE, 0 };
+		obj->command_queue_ = clCreateCommandQueueWithProperties(obj->context_, device_id, options.profiling ? queue_properties : NULL, &ret);
+		if (ret != CL_SUCCESS)
+		{
+			obj->command_queue_ = nullptr;
+			return {};
+		}
+		for (size_t index = 1; index < options.queues; ++index)
+		{
+			cl_command_queue queue = clCreateCommandQueueWithProperties(obj->context_, device_id, options.profiling ? queue_properties : NULL, &ret);
+			if (ret != CL_SUCCESS)
+			{
+				return {};
+			}
+			obj->extra_queues_.push_back(queue);
+		}
+
+		obj->vector_width_ = options.vector_width;
+		if (obj->vector_width_ == 0)
+		{
+			cl_device_type device_type = 0;
+			cl_uint native_width = 0;
+			clGetDeviceInfo(device_id, CL_DEVICE_TYPE, sizeof(cl_device_type), &device_type, NULL);
+			clGetDeviceInfo(device_id, CL_DEVICE_NATIVE_VECTOR_WIDTH_FLOAT, sizeof(cl_uint), &native_width, NULL);
+
+			// CPUs want whole SIMD registers, GPUs wider loads per work-item
+			obj->vector_width_ = (device_type & CL_DEVICE_TYPE_CPU) && native_width >= 8 ? 8 : 4;
+		}
+		if (obj->vector_width_ != 1 && obj->vector_width_ != 4 && obj->vector_width_ != 8)
+		{
+			return {};
+		}
+
+		// A device that rejects the fast math build still gets the precise one
+		if (!obj->createKernels(options.fast_math) && !(options.fast_math && obj->createKernels(false)))
+		{
+			return {};
+		}
+
+		// Pipelines of other sizes and windows are built on first use
+		if (obj->findPipeline(sample_count) == nullptr)
+		{
+			return {};
+		}
+
+		if (obj->fast_math_ && !obj->checkAccuracy(options.fast_math_tolerance_db))
+		{
+			// Start over with full precision kernels, the pipeline was tuned for the fast ones
+			for (auto& entry : obj->pipelines_)
+			{
+				obj->releasePipeline(*entry.second);
+			}
+			obj->pipelines_.clear();
+			obj->releaseKernels();
+
+			if (!obj->createKernels(false) || obj->findPipeline(sample_count) == nullptr)
+			{
+				return {};
+			}
+		}
+
+		// Only now, so the accuracy test frame does not end up in the traces or the averages
+		obj->setTraces(options.traces);
+		obj->setAveraging(options.averaging);
+
+		return obj;
+	}
+
+	auto ModuleSignalProcessing::perform(const std::shared_ptr<AllignedBufferI16C>& rawData ) ->std::shared_ptr<AllignedBufferF>
+	{
+		while (!submitted_.empty())
+		{
+			wait();
+		}
+
+		if (!submit(rawData))
+		{
+			return {};
+		}
+
+		return wait();
+	}
+
+	auto ModuleSignalProcessing::performAsync(const std::shared_ptr<AllignedBufferI16C>& rawData, std::shared_ptr<AllignedBufferF>& retBuffer) ->bool
+	{
+		retBuffer.reset();
+		if (submitted_.size() == max_in_flight_)
+		{
+			retBuffer = wait();
+		}
+
+		return submit(rawData);
+	}
+
+	auto ModuleSignalProcessing::performBatch(const std::vector<std::shared_ptr<AllignedBufferI16C>>& frames) ->std::vector<std::shared_ptr<AllignedBufferF>>
+	{
+		while (!submitted_.empty())
+		{
+			waitBatch();
+		}
+
+		if (!submitBatch(frames))
+		{
+			return {};
+		}
+
+		return waitBatch();
+	}
+
+	auto ModuleSignalProcessing::submit(const std::shared_ptr<AllignedBufferI16C>& rawData) ->bool
+	{
+		return submitBatch({ rawData });
+	}
+
+	auto ModuleSignalProcessing::wait() ->std::shared_ptr<AllignedBufferF>
+	{
+		auto retBuffers = waitBatch();
+		if (retBuffers.empty())
+		{
+			return {};
+		}
+
+		return retBuffers.front();
+	}
+
+	auto ModuleSignalProcessing::submitBatch(const std::vector<std::shared_ptr<AllignedBufferI16C>>& frames) ->bool
+	{
+		if (frames.empty() || frames.size() > batch_ || submitted_.size() == max_in_flight_ || !frames.front())
+		{
+			return false;
+		}
+
+		// One submission is one transform, so all of its frames share the size
+		const size_t sample_count = frames.front()->size();
+		for (const auto& rawData : frames)
+		{
+			if (!rawData || rawData->size() != sample_count)
+			{
+				return false;
+			}
+		}
+
+		Pipeline* pipeline = findPipeline(sample_count);
+		if (pipeline == nullptr)
+		{
+			return false;
+		}
+
+		return submitFrames(pipeline, frames, nullptr);
+	}
+
+	void ModuleSignalProcessing::resetStream()
+	{
+		for (auto& entry : pipelines_)
+		{
+			entry.second->stream_valid_ = 0;
+			entry.second->stream_consumed_ = 0;
+		}
+	}
+
+	auto ModuleSignalProcessing::submitStream(const std::shared_ptr<AllignedBufferI16C>& block) ->bool
+	{
+		if (!block || submitted_.size() == max_in_flight_ || averaging_.mode != AVERAGING_NONE)
+		{
+			return false;
+		}
+
+		Pipeline* pipeline = findPipeline(sample_count_);
+		if (pipeline == nullptr)
+		{
+			return false;
+		}
+
+		const size_t sample_count = pipeline->sample_count_;
+		const size_t hop = stream_hop_ == 0 ? sample_count : std::min(stream_hop_, sample_count);
+		const size_t sample_bytes = sizeof(std::complex<int16_t>);
+		cl_int ret;
+
+		// The samples after the next frame start move to the front of the other buffer, the block goes behind them.
+		// Both copies run on the first queue, in order with every kernel still reading either buffer.
+		const size_t current = pipeline->stream_current_;
+		const size_t target = 1 - current;
+		const size_t kept = pipeline->stream_valid_ - pipeline->stream_consumed_;
+		const size_t valid = kept + block->size();
+		if (pipeline->stream_capacity_[target] < valid)
+		{
+			if (pipeline->stream_buffers_[target] != nullptr)
+			{
+				clReleaseMemObject(pipeline->stream_buffers_[target]);
+				pipeline->stream_buffers_[target] = nullptr;
+			}
+			const size_t capacity = std::max(valid, 2 * pipeline->stream_capacity_[target]);
+			if (!ensureBuffer(pipeline->stream_buffers_[target], capacity * sample_bytes))
+			{
+				pipeline->stream_capacity_[target] = 0;
+				return false;
+			}
+			pipeline->stream_capacity_[target] = capacity;
+		}
+
+		StreamInput stream;
+		stream.buffer_ = pipeline->stream_buffers_[target];
+		stream.stride_ = cl_int(hop);
+		if (kept > 0)
+		{
+			cl_event copied;
+			ret = clEnqueueCopyBuffer(command_queue_, pipeline->stream_buffers_[current], stream.buffer_, pipeline->stream_consumed_ * sample_bytes, 0, kept * sample_bytes, 0, NULL, &copied);
+			stream.uploaded_.push_back(copied);
+		}
+		if (block->size() > 0)
+		{
+			cl_event written;
+			ret = clEnqueueWriteBuffer(command_queue_, stream.buffer_, CL_FALSE, kept * sample_bytes, block->size() * sample_bytes, block->data(), 0, NULL, &written);
+			stream.uploaded_.push_back(written);
+		}
+
+		stream.frame_count_ = valid >= sample_count ? std::min((valid - sample_count) / hop + 1, batch_) : 0;
+
+		// The stream only moves on to the other buffer once the submission is queued; after a
+		// failure the next call copies the same samples again. The upload still reads block.
+		if (!submitFrames(pipeline, { block }, &stream))
+		{
+			if (!stream.uploaded_.empty())
+			{
+				clWaitForEvents(cl_uint(stream.uploaded_.size()), stream.uploaded_.data());
+			}
+			for (auto ev : stream.uploaded_)
+			{
+				clReleaseEvent(ev);
+			}
+			return false;
+		}
+
+		pipeline->stream_current_ = target;
+		pipeline->stream_valid_ = valid;
+		pipeline->stream_consumed_ = stream.frame_count_ * hop;
+
+		return true;
+	}
+
+	auto ModuleSignalProcessing::submitFrames(Pipeline* pipeline, const std::vector<std::shared_ptr<AllignedBufferI16C>>& frames, StreamInput* stream) ->bool
+	{
+		// Quinn's estimator assumes the bins of an unwindowed tone, any other window biases it towards the bin
+		if ((outputs_ & OUTPUT_PEAKS) && averaging_.mode == AVERAGING_NONE && peaks_.interpolation == PEAK_QUINN && win_type_ != WindowFunction::WIN_RECTANGULAR)
+		{
+			return false;
+		}
+
+		const size_t sample_count = pipeline->sample_count_;
+		auto& slot = pipeline->slots_[pipeline->next_slot_];
+		releaseEvents(slot);
+
+		// Consecutive submissions alternate between the queues, so one can copy while another computes.
+		// A stream stays on the first queue, where its buffers are written.
+		cl_command_queue queue = command_queue_;
+		if (!stream)
+		{
+			queue = next_queue_ == 0 ? command_queue_ : extra_queues_[next_queue_ - 1];
+			next_queue_ = (next_queue_ + 1) % (extra_queues_.size() + 1);
+		}
+
+		const size_t frame_count = stream ? stream->frame_count_ : frames.size();
+		const unsigned outputs = outputs_;
+		const bool tracing = traces_ != 0 && averaging_.mode == AVERAGING_NONE;
+		const output_format db_format = db_format_;
+		const bool use_fused = pipeline->fused_ && outputs == OUTPUT_DB && db_format == FORMAT_FLOAT32 && !tracing && !stream;
+		const bool postprocess = !use_fused && ((outputs & (OUTPUT_POWER | OUTPUT_DB | OUTPUT_DISPLAY | OUTPUT_PEAKS)) != 0 || tracing);
+		// OUTPUT_DISPLAY and OUTPUT_PEAKS reduce the float dB spectrum, which then stays on the device unless it is downloaded too
+		const bool db_float = (outputs & OUTPUT_DB) && db_format == FORMAT_FLOAT32;
+		const bool db_packed = (outputs & OUTPUT_DB) && db_format != FORMAT_FLOAT32;
+		const bool db_stage = db_float || (outputs & (OUTPUT_DISPLAY | OUTPUT_PEAKS)) != 0;
+		const size_t peak_capacity = sample_count / 2;
+		const size_t display_values = display_.bins * (display_.reduction == DISPLAY_MIN_MAX ? 2 : 1);
+		cl_int ret;
+
+		// Averages only report power and dB, none of the per-frame buffers below are used
+		if (averaging_.mode != AVERAGING_NONE)
+		{
+			if (!submitAveraging(*pipeline, slot, frames))
+			{
+				return false;
+			}
+
+			pipeline->next_slot_ = (pipeline->next_slot_ + 1) % pipeline->slots_.size();
+			++pipeline->in_flight_;
+			submitted_.push_back(pipeline);
+
+			return true;
+		}
+
+		if ((outputs & OUTPUT_POWER) && !ensureBuffer(slot.signal_linear_out_, sample_count * batch_ * sizeof(float)))
+		{
+			return false;
+		}
+		if (db_stage && !ensureBuffer(slot.signal_power_out_, sample_count * batch_ * sizeof(float)))
+		{
+			return false;
+		}
+		if (db_packed && !ensureBuffer(slot.packed_out_, sample_count * batch_ * sizeof(int16_t)))
+		{
+			return false;
+		}
+		if ((outputs & OUTPUT_DISPLAY) && !ensureBuffer(slot.display_out_, display_values * batch_ * sizeof(float)))
+		{
+			return false;
+		}
+		if ((outputs & OUTPUT_PEAKS) && !(ensureBuffer(slot.peak_bins_, peak_capacity * batch_ * sizeof(cl_int))
+			&& ensureBuffer(slot.peak_db_, peak_capacity * batch_ * sizeof(float))
+			&& ensureBuffer(slot.peak_counts_, batch_ * sizeof(cl_int))
+			&& ensureBuffer(slot.peaks_out_, peaks_.count * batch_ * sizeof(Peak))))
+		{
+			return false;
+		}
+		if (tracing && !ensureBuffer(pipeline->traces_, 3 * sample_count * sizeof(float)))
+		{
+			return false;
+		}
+
+		if (stream && frame_count == 0)
+		{
+			// Nothing but the upload, wait() only has to keep the block alive until it is done
+			slot.input_ = frames;
+			slot.result_.clear();
+			slot.upload_done_ = std::move(stream->uploaded_);
+			ret = clFlush(queue);
+
+			pipeline->next_slot_ = (pipeline->next_slot_ + 1) % pipeline->slots_.size();
+			++pipeline->in_flight_;
+			submitted_.push_back(pipeline);
+
+			return true;
+		}
+
+		// Frames from allocateInput() are handed to the device by unmapping them, once
+		std::vector<std::shared_ptr<HostMapping>> input_mappings(frame_count);
+		if (zero_copy_ && !stream)
+		{
+			std::lock_guard<std::mutex> lock(host_registry_->mutex_);
+			for (size_t frame = 0; frame < frame_count; ++frame)
+			{
+				auto it = host_registry_->inputs_.find(frames[frame]->data());
+				if (it != host_registry_->inputs_.end())
+				{
+					input_mappings[frame] = it->second.lock();
+				}
+				if (input_mappings[frame] && input_mappings[frame]->in_flight_)
+				{
+					for (size_t previous = 0; previous < frame; ++previous)
+					{
+						if (input_mappings[previous]) input_mappings[previous]->in_flight_ = false;
+					}
+					return false;
+				}
+				if (input_mappings[frame]) input_mappings[frame]->in_flight_ = true;
+			}
+		}
+
+		// The host buffers are only touched again by wait(), after download_done_ fired
+		slot.input_ = frames;
+		slot.result_.assign(frame_count, Spectrum{});
+		if (outputs & OUTPUT_COMPLEX)
+		{
+			for (auto& spectrum : slot.result_)
+			{
+				spectrum.bins = std::make_shared<AllignedBufferFC>(sample_count);
+			}
+		}
+
+		// Set the arguments of the kernel
+		{
+			// A single mapped frame is read in place by the window kernel, otherwise frames are gathered into the slot buffer
+			cl_mem input = (!use_fused && frame_count == 1 && input_mappings[0]) ? input_mappings[0]->mem_ : slot.mem_obj_input_;
+			cl_int stride = cl_int(sample_count);
+			if (stream)
+			{
+				input = stream->buffer_;
+				stride = stream->stride_;
+			}
+
+			ret = clSetKernelArg(pipeline->preprocess_, 0, sizeof(cl_mem), (void*)& input);
+			ret = clSetKernelArg(pipeline->preprocess_, 1, sizeof(cl_mem), (void*)& pipeline->mem_obj_window_);
+			ret = clSetKernelArg(pipeline->preprocess_, 2, sizeof(cl_mem), (void*)& slot.mem_obj_fft_);
+			ret = clSetKernelArg(pipeline->preprocess_, 3, sizeof(cl_int), (void*)& pipeline->items_preprocess_);
+			ret = clSetKernelArg(pipeline->preprocess_, 4, sizeof(cl_int), (void*)& stride);
+
+			// Non-blocking uploads, the kernel waits for them through upload_done_. A stream was uploaded by submitStream().
+			if (stream)
+			{
+				slot.upload_done_ = std::move(stream->uploaded_);
+			}
+			else
+			{
+				slot.upload_done_.resize(frame_count);
+			}
+			for (size_t frame = 0; !stream && frame < frame_count; ++frame)
+			{
+				const size_t frame_bytes = sample_count * sizeof(std::complex<int16_t>);
+				auto& mapping = input_mappings[frame];
+				if (!mapping)
+				{
+					ret = clEnqueueWriteBuffer(queue, slot.mem_obj_input_, CL_FALSE, frame * frame_bytes, frame_bytes, frames[frame]->data(), 0, NULL, &slot.upload_done_[frame]);
+					continue;
+				}
+
+				ret = clEnqueueUnmapMemObject(queue, mapping->mem_, mapping->ptr_, 0, NULL, &slot.upload_done_[frame]);
+				mapping->mapped_ = false;
+				if (input != mapping->mem_)
+				{
+					cl_event unmapped = slot.upload_done_[frame];
+					ret = clEnqueueCopyBuffer(queue, mapping->mem_, slot.mem_obj_input_, 0, frame * frame_bytes, frame_bytes, 1, &unmapped, &slot.upload_done_[frame]);
+					clReleaseEvent(unmapped);
+				}
+			}
+
+			if (use_fused)
+			{
+				// The pre-callback of the transform does the windowing
+				ret = clfftEnqueueTransform(slot.fused_plan_, CLFFT_FORWARD, 1, &queue, cl_uint(frame_count), slot.upload_done_.data(), &slot.fft_done_, &input, &slot.mem_obj_fft_, slot.tmp_buffer_);
+			}
+			else
+			{
+				// Execute the OpenCL kernel on the list
+				size_t global_item_size[] = { roundUp(pipeline->items_preprocess_, pipeline->local_preprocess_), frame_count }; // Process the entire lists of every frame
+				size_t local_item_size[] = { pipeline->local_preprocess_, 1 }; // Tuned per device and size
+				ret = clEnqueueNDRangeKernel(queue, pipeline->preprocess_, 2, NULL, global_item_size, local_item_size[0] != 0 ? local_item_size : NULL, cl_uint(slot.upload_done_.size()), slot.upload_done_.empty() ? NULL : slot.upload_done_.data(), &slot.window_done_);
+			}
+
+			// Give the mapped frames back to the host once the samples were consumed
+			cl_event consumed = use_fused ? slot.fft_done_ : slot.window_done_;
+			for (auto& mapping : input_mappings)
+			{
+				if (mapping)
+				{
+					cl_event remapped;
+					clEnqueueMapBuffer(queue, mapping->mem_, CL_FALSE, CL_MAP_READ | CL_MAP_WRITE, 0, mapping->bytes_, 1, &consumed, &remapped, &ret);
+					mapping->mapped_ = true;
+					slot.download_done_.push_back(remapped);
+				}
+			}
+			slot.input_mappings_ = input_mappings;
+		}
+
+		// Queues one non-blocking read per frame that waits for ready, the events end up in download_done_
+		auto download = [&](cl_mem mem, size_t sample_bytes, cl_event ready, auto host_data)
+		{
+			const size_t frame_bytes = sample_count * sample_bytes;
+			for (size_t frame = 0; frame < frame_count; ++frame)
+			{
+				cl_event done;
+				ret = clEnqueueReadBuffer(queue, mem, CL_FALSE, frame * frame_bytes, frame_bytes, host_data(slot.result_[frame]), 1, &ready, &done);
+				slot.download_done_.push_back(done);
+			}
+		};
+
+		if (use_fused)
+		{
+			// The post-callback already stored the dB spectrum
+			for (auto& spectrum : slot.result_)
+			{
+				spectrum.db = std::make_shared<AllignedBufferF>(sample_count);
+			}
+			download(slot.signal_power_out_, sizeof(float), slot.fft_done_, [](Spectrum& s) { return (void*)s.db->data(); });
+		}
+		else
+		{
+			//////////////////////////////////////////////////////////////////////////
+		/* Execute the plan. */
+			ret = clfftEnqueueTransform(pipeline->planHandle_, CLFFT_FORWARD, 1, &queue, 1, &slot.window_done_, &slot.fft_done_, &slot.mem_obj_fft_, NULL, slot.tmp_buffer_);
+
+			if (outputs & OUTPUT_COMPLEX)
+			{
+				download(slot.mem_obj_fft_, sizeof(std::complex<float>), slot.fft_done_, [](Spectrum& s) { return (void*)s.bins->data(); });
+			}
+		}
+
+		//////////////////////////////////////////////////////////////////////////
+		if (postprocess)
+		{
+			// In zero copy mode the kernel writes straight into mapped host memory shared by the spectra
+			std::shared_ptr<HostMapping> power_mapping;
+			std::shared_ptr<HostMapping> db_mapping;
+			std::vector<cl_event> unmapped;
+			if (zero_copy_)
+			{
+				if (outputs & OUTPUT_POWER) power_mapping = reuseHostMemory(slot.power_mapping_, batch_ * sample_count * sizeof(float), queue, unmapped);
+				if (db_float) db_mapping = reuseHostMemory(slot.db_mapping_, batch_ * sample_count * sizeof(float), queue, unmapped);
+			}
+
+			cl_mem power_out = nullptr;
+			cl_mem db_out = nullptr;
+			if (outputs & OUTPUT_POWER)
+			{
+				power_out = power_mapping ? power_mapping->mem_ : slot.signal_linear_out_;
+			}
+			if (db_stage)
+			{
+				db_out = db_mapping ? db_mapping->mem_ : slot.signal_power_out_;
+			}
+
+			ret = clSetKernelArg(pipeline->postprocess_, 0, sizeof(cl_mem), (void*)& slot.mem_obj_fft_);
+			ret = clSetKernelArg(pipeline->postprocess_, 1, sizeof(cl_mem), power_out ? (void*)& power_out : NULL);
+			ret = clSetKernelArg(pipeline->postprocess_, 2, sizeof(cl_mem), db_out ? (void*)& db_out : NULL);
+			ret = clSetKernelArg(pipeline->postprocess_, 3, sizeof(cl_int), (void*)& pipeline->items_postprocess_);
+
+			// The traces carry over between submissions, so their updates wait for the previous one on any queue
+			const cl_int trace_mask = tracing ? cl_int(traces_) : 0;
+			const cl_int trace_reset = pipeline->traces_reset_ ? 1 : 0;
+			ret = clSetKernelArg(pipeline->postprocess_, 4, sizeof(cl_mem), tracing ? (void*)& pipeline->traces_ : NULL);
+			ret = clSetKernelArg(pipeline->postprocess_, 5, sizeof(cl_int), (void*)& trace_mask);
+			ret = clSetKernelArg(pipeline->postprocess_, 6, sizeof(float), (void*)& persistence_decay_db_);
+			ret = clSetKernelArg(pipeline->postprocess_, 7, sizeof(cl_int), (void*)& trace_reset);
+			ret = clSetKernelArg(pipeline->postprocess_, 8, sizeof(cl_mem), db_format == FORMAT_HALF && db_packed ? (void*)& slot.packed_out_ : NULL);
+			ret = clSetKernelArg(pipeline->postprocess_, 9, sizeof(cl_mem), db_format == FORMAT_CENTI_DB && db_packed ? (void*)& slot.packed_out_ : NULL);
+			std::vector<cl_event> postprocess_wait = { slot.fft_done_ };
+			if (tracing && pipeline->traces_done_ != nullptr)
+			{
+				postprocess_wait.push_back(pipeline->traces_done_);
+			}
+			postprocess_wait.insert(postprocess_wait.end(), unmapped.begin(), unmapped.end());
+
+			// Execute the OpenCL kernel on the list
+			size_t global_item_size[] = { roundUp(pipeline->items_postprocess_, pipeline->local_postprocess_), frame_count }; // Process the entire lists of every frame
+			size_t local_item_size[] = { pipeline->local_postprocess_, 1 }; // Tuned per device and size
+			ret = clEnqueueNDRangeKernel(queue, pipeline->postprocess_, 2, NULL, global_item_size, local_item_size[0] != 0 ? local_item_size : NULL, cl_uint(postprocess_wait.size()), postprocess_wait.data(), &slot.postprocess_done_);
+			for (auto ev : unmapped)
+			{
+				clReleaseEvent(ev);
+			}
+
+			if (tracing && ret == CL_SUCCESS)
+			{
+				if (pipeline->traces_done_ != nullptr) clReleaseEvent(pipeline->traces_done_);
+				clRetainEvent(slot.postprocess_done_);
+				pipeline->traces_done_ = slot.postprocess_done_;
+				pipeline->traces_reset_ = false;
+			}
+
+			if (db_packed && db_format == FORMAT_HALF)
+			{
+				for (auto& spectrum : slot.result_)
+				{
+					spectrum.db_half = std::make_shared<AllignedBufferF16>(sample_count);
+				}
+				download(slot.packed_out_, sizeof(uint16_t), slot.postprocess_done_, [](Spectrum& s) { return (void*)s.db_half->data(); });
+			}
+			else if (db_packed)
+			{
+				for (auto& spectrum : slot.result_)
+				{
+					spectrum.db_centi = std::make_shared<AllignedBufferI16>(sample_count);
+				}
+				download(slot.packed_out_, sizeof(int16_t), slot.postprocess_done_, [](Spectrum& s) { return (void*)s.db_centi->data(); });
+			}
+
+			if (outputs & OUTPUT_DISPLAY)
+			{
+				const cl_int count = cl_int(sample_count);
+				const cl_int first = cl_int(std::min(display_.first_bin, sample_count - 1));
+				const cl_int span = cl_int(display_.span == 0 ? sample_count - first : std::min(display_.span, sample_count - first));
+				const cl_int buckets = cl_int(display_.bins);
+				const cl_int reduction = cl_int(display_.reduction);
+				ret = clSetKernelArg(kernel_display_, 0, sizeof(cl_mem), (void*)& db_out);
+				ret = clSetKernelArg(kernel_display_, 1, sizeof(cl_mem), (void*)& slot.display_out_);
+				ret = clSetKernelArg(kernel_display_, 2, sizeof(cl_int), (void*)& count);
+				ret = clSetKernelArg(kernel_display_, 3, sizeof(cl_int), (void*)& first);
+				ret = clSetKernelArg(kernel_display_, 4, sizeof(cl_int), (void*)& span);
+				ret = clSetKernelArg(kernel_display_, 5, sizeof(cl_int), (void*)& buckets);
+				ret = clSetKernelArg(kernel_display_, 6, sizeof(cl_int), (void*)& reduction);
+				size_t display_size[] = { display_.bins, frame_count };
+				ret = clEnqueueNDRangeKernel(queue, kernel_display_, 2, NULL, display_size, NULL, 1, &slot.postprocess_done_, &slot.display_done_);
+
+				const size_t display_bytes = display_values * sizeof(float);
+				for (size_t frame = 0; frame < frame_count; ++frame)
+				{
+					auto& display = slot.result_[frame].display;
+					display = std::make_shared<AllignedBufferF>(display_values);
+					cl_event done;
+					ret = clEnqueueReadBuffer(queue, slot.display_out_, CL_FALSE, frame * display_bytes, display_bytes, display->data(), 1, &slot.display_done_, &done);
+					slot.download_done_.push_back(done);
+				}
+			}
+
+			// The peak stage works on its own candidate list, db_out is never written
+			if (outputs & OUTPUT_PEAKS)
+			{
+				const cl_int count = cl_int(sample_count);
+				const cl_int capacity = cl_int(peak_capacity);
+				const cl_int peak_count = cl_int(peaks_.count);
+				const cl_int quinn = peaks_.interpolation == PEAK_QUINN ? 1 : 0;
+				const cl_int zero = 0;
+
+				cl_event cleared;
+				ret = clEnqueueFillBuffer(queue, slot.peak_counts_, &zero, sizeof(zero), 0, frame_count * sizeof(cl_int), 0, NULL, &cleared);
+
+				cl_event found;
+				cl_event candidates_wait[] = { slot.postprocess_done_, cleared };
+				ret = clSetKernelArg(kernel_peak_candidates_, 0, sizeof(cl_mem), (void*)& db_out);
+				ret = clSetKernelArg(kernel_peak_candidates_, 1, sizeof(cl_mem), (void*)& slot.peak_bins_);
+				ret = clSetKernelArg(kernel_peak_candidates_, 2, sizeof(cl_mem), (void*)& slot.peak_db_);
+				ret = clSetKernelArg(kernel_peak_candidates_, 3, sizeof(cl_mem), (void*)& slot.peak_counts_);
+				ret = clSetKernelArg(kernel_peak_candidates_, 4, sizeof(cl_int), (void*)& count);
+				ret = clSetKernelArg(kernel_peak_candidates_, 5, sizeof(cl_int), (void*)& capacity);
+				ret = clSetKernelArg(kernel_peak_candidates_, 6, sizeof(float), (void*)& peaks_.threshold_db);
+				size_t candidates_size[] = { sample_count, frame_count };
+				ret = clEnqueueNDRangeKernel(queue, kernel_peak_candidates_, 2, NULL, candidates_size, NULL, 2, candidates_wait, &found);
+
+				ret = clSetKernelArg(kernel_peak_topk_, 0, sizeof(cl_mem), (void*)& db_out);
+				ret = clSetKernelArg(kernel_peak_topk_, 1, sizeof(cl_mem), (void*)& slot.mem_obj_fft_);
+				ret = clSetKernelArg(kernel_peak_topk_, 2, sizeof(cl_mem), (void*)& slot.peak_bins_);
+				ret = clSetKernelArg(kernel_peak_topk_, 3, sizeof(cl_mem), (void*)& slot.peak_db_);
+				ret = clSetKernelArg(kernel_peak_topk_, 4, sizeof(cl_mem), (void*)& slot.peak_counts_);
+				ret = clSetKernelArg(kernel_peak_topk_, 5, sizeof(cl_mem), (void*)& slot.peaks_out_);
+				ret = clSetKernelArg(kernel_peak_topk_, 6, sizeof(cl_int), (void*)& count);
+				ret = clSetKernelArg(kernel_peak_topk_, 7, sizeof(cl_int), (void*)& capacity);
+				ret = clSetKernelArg(kernel_peak_topk_, 8, sizeof(cl_int), (void*)& peak_count);
+				ret = clSetKernelArg(kernel_peak_topk_, 9, sizeof(cl_int), (void*)& quinn);
+				ret = clSetKernelArg(kernel_peak_topk_, 10, peak_local_ * sizeof(float), NULL);
+				ret = clSetKernelArg(kernel_peak_topk_, 11, peak_local_ * sizeof(cl_int), NULL);
+				size_t topk_size[] = { peak_local_, frame_count };
+				size_t topk_local[] = { peak_local_, 1 };
+				ret = clEnqueueNDRangeKernel(queue, kernel_peak_topk_, 2, NULL, topk_size, topk_local, 1, &found, &slot.peaks_done_);
+				clReleaseEvent(cleared);
+				clReleaseEvent(found);
+
+				// Unused entries have bin -1, waitSpectra() trims them
+				const size_t peaks_bytes = peaks_.count * sizeof(Peak);
+				for (size_t frame = 0; frame < frame_count; ++frame)
+				{
+					auto& peaks = slot.result_[frame].peaks;
+					peaks.resize(peaks_.count);
+					cl_event done;
+					ret = clEnqueueReadBuffer(queue, slot.peaks_out_, CL_FALSE, frame * peaks_bytes, peaks_bytes, peaks.data(), 1, &slot.peaks_done_, &done);
+					slot.download_done_.push_back(done);
+				}
+			}
+
+			// Either map the shared host block and hand out views into it, or copy each frame out.
+			// The block is mapped only behind the reductions, they read the dB spectrum from it.
+			std::vector<cl_event> reduced = { slot.postprocess_done_ };
+			if (slot.display_done_ != nullptr) reduced.push_back(slot.display_done_);
+			if (slot.peaks_done_ != nullptr) reduced.push_back(slot.peaks_done_);
+			auto collect = [&](const std::shared_ptr<HostMapping>& mapping, cl_mem mem, std::shared_ptr<AllignedBufferF> Spectrum::* stage)
+			{
+				if (!mapping)
+				{
+					for (auto& spectrum : slot.result_)
+					{
+						spectrum.*stage = std::make_shared<AllignedBufferF>(sample_count);
+					}
+					download(mem, sizeof(float), slot.postprocess_done_, [stage](Spectrum& s) { return (void*)(s.*stage)->data(); });
+					return;
+				}
+
+				cl_event mapped;
+				clEnqueueMapBuffer(queue, mapping->mem_, CL_FALSE, CL_MAP_READ, 0, mapping->bytes_, cl_uint(reduced.size()), reduced.data(), &mapped, &ret);
+				mapping->mapped_ = true;
+				slot.download_done_.push_back(mapped);
+
+				for (size_t frame = 0; frame < frame_count; ++frame)
+				{
+					slot.result_[frame].*stage = std::make_shared<AllignedBufferF>(sample_count, (float*)mapping->ptr_ + frame * sample_count, [mapping]() {});
+				}
+			};
+
+			if (outputs & OUTPUT_POWER)
+			{
+				collect(power_mapping, power_out, &Spectrum::power);
+			}
+			if (db_float)
+			{
+				collect(db_mapping, db_out, &Spectrum::db);
+			}
+		}
+
+		// Kick the device, but do not wait for it
+		ret = clFlush(queue);
+
+		pipeline->next_slot_ = (pipeline->next_slot_ + 1) % pipeline->slots_.size();
+		++pipeline->in_flight_;
+		submitted_.push_back(pipeline);
+
+		return true;
+	}
+
+	auto ModuleSignalProcessing::profile(stage s) const ->StageProfile
+	{
+		if (!profiler_)
+		{
+			return {};
+		}
+
+		return profiler_->profile(s);
+	}
+
+	void ModuleSignalProcessing::resetProfile()
+	{
+		if (profiler_)
+		{
+			profiler_->reset();
+		}
+	}
+
+	auto ModuleSignalProcessing::waitBatch() ->std::vector<std::shared_ptr<AllignedBufferF>>
+	{
+		std::vector<std::shared_ptr<AllignedBufferF>> retBuffers;
+		for (auto& spectrum : waitSpectra())
+		{
+			retBuffers.push_back(std::move(spectrum.db));
+		}
+
+		return retBuffers;
+	}
+
+	auto ModuleSignalProcessing::waitSpectra() ->std::vector<Spectrum>
+	{
+		if (submitted_.empty())
+		{
+			return {};
+		}
+
+		// Submissions finish in order, so the oldest one is also the oldest of its pipeline
+		Pipeline* pipeline = submitted_.front();
+		submitted_.pop_front();
+
+		auto& slot = pipeline->slots_[(pipeline->next_slot_ + pipeline->slots_.size() - pipeline->in_flight_) % pipeline->slots_.size()];
+		--pipeline->in_flight_;
+
+		// Without any download the last kernel of the frame is waited for instead, without a frame the upload
+		cl_int ret = CL_SUCCESS;
+		if (!slot.download_done_.empty())
+		{
+			ret = clWaitForEvents(cl_uint(slot.download_done_.size()), slot.download_done_.data());
+		}
+		else if (slot.postprocess_done_ != nullptr || slot.fft_done_ != nullptr)
+		{
+			ret = clWaitForEvents(1, slot.postprocess_done_ != nullptr ? &slot.postprocess_done_ : &slot.fft_done_);
+		}
+		else if (!slot.upload_done_.empty())
+		{
+			ret = clWaitForEvents(cl_uint(slot.upload_done_.size()), slot.upload_done_.data());
+		}
+
+		last_device_seconds_ = 0.0;
+		if (profiler_ && ret == CL_SUCCESS)
+		{
+			std::vector<cl_event> all = slot.upload_done_;
+			for (auto ev : { slot.window_done_, slot.fft_done_, slot.postprocess_done_, slot.display_done_, slot.peaks_done_ })
+			{
+				if (ev != nullptr) all.push_back(ev);
+			}
+			all.insert(all.end(), slot.download_done_.begin(), slot.download_done_.end());
+			last_device_seconds_ = StageProfiler::busySeconds(all);
+
+			profiler_->record(STAGE_UPLOAD, slot.upload_done_.data(), slot.upload_done_.size());
+			if (slot.window_done_ != nullptr) profiler_->record(STAGE_WINDOW, &slot.window_done_, 1);
+			// clFFT only returns the last kernel of its plan, the transform runs from the end of the step before it
+			if (slot.fft_done_ != nullptr)
+			{
+				if (slot.window_done_ != nullptr)
+				{
+					profiler_->record(STAGE_FFT, &slot.fft_done_, 1, &slot.window_done_, 1);
+				}
+				else
+				{
+					profiler_->record(STAGE_FFT, &slot.fft_done_, 1, slot.upload_done_.data(), slot.upload_done_.size());
+				}
+			}
+			if (slot.postprocess_done_ != nullptr) profiler_->record(STAGE_POSTPROCESS, &slot.postprocess_done_, 1);
+			profiler_->record(STAGE_DOWNLOAD, slot.download_done_.data(), slot.download_done_.size());
+		}
+		releaseEvents(slot);
+
+		std::vector<Spectrum> retSpectra = std::move(slot.result_);
+		for (auto& mapping : slot.input_mappings_)
+		{
+			if (mapping) mapping->in_flight_ = false;
+		}
+		slot.input_mappings_.clear();
+		slot.input_.clear();
+		slot.result_.clear();
+
+		for (auto& spectrum : retSpectra)
+		{
+			auto unused = std::find_if(spectrum.peaks.begin(), spectrum.peaks.end(), [](const Peak& peak) { return peak.bin < 0; });
+			spectrum.peaks.erase(unused, spectrum.peaks.end());
+		}
+
+		if (ret != CL_SUCCESS)
+		{
+			return {};
+		}
+
+		return retSpectra;
 	}
 }
\ No newline at end of file
@@ -1,49 +1,681 @@
 #pragma once
 
+#include "StageProfiler.h"
 #include "../libFFT/WindowFunction.h"
 
+#include <deque>
+#include <map>
 #include <memory>
+#include <string>
 #include <vector>
 
 class AllignedBufferF;
+class AllignedBufferF16;
 class AllignedBufferFC;
+class AllignedBufferI16;
 class AllignedBufferI16C;
 
 typedef struct _cl_context* cl_context;
 typedef struct _cl_kernel* cl_kernel;
-typedef struct _cl_program* cl_program;
 typedef struct _cl_command_queue* cl_command_queue;
 typedef struct _cl_mem* cl_mem;
+typedef struct _cl_event* cl_event;
 
-typedef struct clfftSetupData_ clfftSetupData;
 typedef size_t clfftPlanHandle;
 
 
 namespace ocl
 {
+	class Runtime;
+
+	/*!
+	 * \brief Stages ModuleSignalProcessing computes and downloads, combine with |.
+	 */
+	enum output_stage {
+		OUTPUT_COMPLEX = 1 << 0, //!< raw clFFT bins, natural order, not scaled
+		OUTPUT_POWER = 1 << 1,   //!< linear power |X/N|^2, DC in the middle
+		OUTPUT_DB = 1 << 2,      //!< 10*log10 of OUTPUT_POWER, DC in the middle
+		OUTPUT_DISPLAY = 1 << 3, //!< OUTPUT_DB reduced to DisplayOptions::bins buckets
+		OUTPUT_PEAKS = 1 << 4,   //!< strongest local maxima of OUTPUT_DB, see PeakOptions
+	};
+
+	/*!
+	 * \brief Storage of the OUTPUT_DB spectrum on download.
+	 */
+	enum output_format {
+		FORMAT_FLOAT32 = 0,  //!< Spectrum::db
+		FORMAT_HALF = 1,     //!< Spectrum::db_half, half floats, about 0.06 dB steps around -100 dB
+		FORMAT_CENTI_DB = 2, //!< Spectrum::db_centi, int16 in 0.01 dB, saturating at +-327.67 dB
+	};
+
+	/*!
+	 * \brief One entry of the OUTPUT_PEAKS list.
+	 *
+	 * The frequency of the peak is (bin + offset - sample_count / 2) * fs / sample_count.
+	 */
+	struct Peak
+	{
+		int bin;      //!< bin of the DC centred spectrum, like OUTPUT_DB
+		float db;     //!< level, the parabola vertex with PEAK_PARABOLIC, the bin itself with PEAK_QUINN
+		float offset; //!< interpolated position of the true peak relative to bin, in bins
+	};
+
+	/*!
+	 * \brief Output of one frame. Stages that were not selected stay nullptr.
+	 */
+	struct Spectrum
+	{
+		std::shared_ptr<AllignedBufferFC> bins;
+		std::shared_ptr<AllignedBufferF> power;
+		std::shared_ptr<AllignedBufferF> db;
+		std::shared_ptr<AllignedBufferF16> db_half;
+		std::shared_ptr<AllignedBufferI16> db_centi;
+		std::shared_ptr<AllignedBufferF> display;
+		std::vector<Peak> peaks; //!< strongest first, at most PeakOptions::count
+	};
+
+	/*!
+	 * \brief How OUTPUT_PEAKS refines the position of a peak between bins.
+	 */
+	enum peak_interpolation {
+		PEAK_PARABOLIC = 0, //!< parabola through the dB values of the peak and its neighbours
+		PEAK_QUINN = 1,     //!< Quinn's second estimator on the complex bins, WIN_RECTANGULAR only
+	};
+
+	/*!
+	 * \brief OUTPUT_PEAKS settings, see ModuleSignalProcessing::setPeaks().
+	 */
+	struct PeakOptions
+	{
+		//! Peaks per frame. At least 1.
+		size_t count = 16;
+
+		//! Only bins above this level qualify.
+		float threshold_db = -80.0f;
+
+		peak_interpolation interpolation = PEAK_PARABOLIC;
+	};
+
+	/*!
+	 * \brief How OUTPUT_DISPLAY reduces the dB bins of a bucket.
+	 */
+	enum display_reduction {
+		DISPLAY_MAX = 0,     //!< highest bin, keeps narrow peaks visible
+		DISPLAY_MEAN = 1,    //!< mean power of the bins, in dB
+		DISPLAY_MIN_MAX = 2, //!< lowest and highest bin, two values per bucket
+	};
+
+	/*!
+	 * \brief OUTPUT_DISPLAY settings, see ModuleSignalProcessing::setDisplay().
+	 */
+	struct DisplayOptions
+	{
+		//! Buckets per frame, i.e. pixels of the spectrum view. At least 1.
+		size_t bins = 2048;
+
+		display_reduction reduction = DISPLAY_MAX;
+
+		//! Sub-span in bins of the DC centred spectrum, first_bin .. first_bin + span.
+		//! A span of 0 runs to the last bin. Clamped to the frame size.
+		size_t first_bin = 0;
+		size_t span = 0;
+	};
+
+	/*!
+	 * \brief How frames and spectra move between host and device.
+	 */
+	enum host_memory {
+		HOST_MEMORY_AUTO = 0,      //!< zero copy when the device reports CL_DEVICE_HOST_UNIFIED_MEMORY
+		HOST_MEMORY_COPY = 1,      //!< separate device buffers, read/write copies
+		HOST_MEMORY_ZERO_COPY = 2, //!< host buffers wrapped with CL_MEM_USE_HOST_PTR, mapped instead of copied
+	};
+
+	/*!
+	 * \brief Traces ModuleSignalProcessing keeps on the device, combine with |.
+	 *
+	 * All of them are in dB with DC in the middle, like OUTPUT_DB.
+	 */
+	enum trace_type {
+		TRACE_MAX_HOLD = 1 << 0,    //!< highest level of every bin since the last reset
+		TRACE_MIN_HOLD = 1 << 1,    //!< lowest level of every bin since the last reset
+		TRACE_PERSISTENCE = 1 << 2, //!< max-hold that falls by the persistence decay every frame
+	};
+
+	/*!
+	 * \brief How ModuleSignalProcessing combines consecutive frames into one spectrum.
+	 */
+	enum averaging_mode {
+		AVERAGING_NONE = 0,        //!< one spectrum per frame
+		AVERAGING_LINEAR = 1,      //!< mean power of every segment of AveragingOptions::frames frames
+		AVERAGING_EXPONENTIAL = 2, //!< running IIR average of the segment power, reported every AveragingOptions::frames frames
+	};
+
+	/*!
+	 * \brief Welch averaging settings, see ModuleSignalProcessing::setAveraging().
+	 */
+	struct AveragingOptions
+	{
+		averaging_mode mode = AVERAGING_NONE;
+
+		//! Frames per reported spectrum. At least 1.
+		size_t frames = 16;
+
+		//! Weight of the newest segment in AVERAGING_EXPONENTIAL.
+		float alpha = 0.1f;
+
+		//! Overlap of consecutive segments in [0, 1), rounded to 1 - 1/k. At 0.5
+		//! every frame yields two segments, the first one starting in the middle
+		//! of the previous frame. Frames whose size k does not divide are
+		//! rejected.
+		float overlap = 0.0f;
+	};
+
+	/*!
+	 * \brief Creation time settings of ModuleSignalProcessing.
+	 */
+	struct ProcessingOptions
+	{
+		//! How many submissions may be queued on the device before wait() has to
+		//! be called. Every pipeline (frame size and window) owns this many
+		//! device buffer sets. At least 1.
+		size_t in_flight = 2;
+
+		//! Frames per submission. The clFFT plan, the device buffers and both
+		//! kernel NDRanges are sized for this many frames. At least 1.
+		size_t batch = 1;
+
+		//! Initial output_stage mask, see ModuleSignalProcessing::setOutputs().
+		unsigned outputs = OUTPUT_DB;
+
+		//! Samples between consecutive frames of submitStream(), 0 selects the
+		//! frame size, i.e. no overlap. See ModuleSignalProcessing::setStreamHop().
+		size_t stream_hop = 0;
+
+		//! Initial OUTPUT_DB storage, see ModuleSignalProcessing::setDbFormat().
+		output_format db_format = FORMAT_FLOAT32;
+
+		host_memory memory = HOST_MEMORY_AUTO;
+
+		//! Run windowing and the dB conversion inside the clFFT transform through
+		//! plan callbacks, see ModuleSignalProcessing::fused().
+		bool fused = false;
+
+		//! Samples per work-item of the window and post-process kernels, 1, 4 or 8.
+		//! 0 picks 8 on CPU devices with 256 bit float vectors and 4 elsewhere.
+		//! Frame sizes that are not a multiple of twice the width run the scalar kernels.
+		size_t vector_width = 0;
+
+		//! Build the window and post-process kernels with -cl-fast-relaxed-math and
+		//! native_log10. Kept only when the dB spectrum of a test frame stays within
+		//! fast_math_tolerance_db of FFTCpu::forward(), otherwise create() falls
+		//! back to full precision. Averaging, display and peak kernels are always
+		//! built with full precision.
+		bool fast_math = true;
+		float fast_math_tolerance_db = 0.05f;
+
+		//! In-order command queues the submissions rotate over. With more than one,
+		//! the uploads and downloads of one submission overlap the kernels of the
+		//! next on devices with separate copy engines; a single queue runs them one
+		//! after the other and only overlaps the host with the device. At least 1.
+		size_t queues = 2;
+
+		//! Initial averaging, see ModuleSignalProcessing::setAveraging().
+		AveragingOptions averaging;
+
+		//! Initial OUTPUT_DISPLAY settings, see ModuleSignalProcessing::setDisplay().
+		DisplayOptions display;
+
+		//! Initial OUTPUT_PEAKS settings, see ModuleSignalProcessing::setPeaks().
+		PeakOptions peaks;
+
+		//! Initial trace_type mask, see ModuleSignalProcessing::setTraces().
+		unsigned traces = 0;
+
+		//! dB the TRACE_PERSISTENCE trace falls per frame.
+		float persistence_decay_db = 0.5f;
+
+		//! Create the queue with CL_QUEUE_PROFILING_ENABLE and collect per-stage
+		//! timings of every submission, see ModuleSignalProcessing::profile().
+		bool profiling = false;
+
+		//! Submissions kept per stage for the profiling statistics.
+		size_t profiling_window = 1024;
+
+		//! Reuse compiled kernels and clFFT plan binaries across processes, see ProgramCache.
+		//! Only used when create() opens a Runtime of its own.
+		bool program_cache = true;
+
+		//! Empty selects ProgramCache::defaultDirectory(). Only used when create()
+		//! opens a Runtime of its own.
+		std::string cache_directory;
+	};
+
 	class ModuleSignalProcessing
 	{
 		ModuleSignalProcessing() = default;
 	public:
 		~ModuleSignalProcessing();
-		static auto create(size_t sample_count , const WindowFunction::win_type win_type) ->std::shared_ptr<ModuleSignalProcessing>;
 
+		/*!
+		 * \brief Open a Runtime of its own and build the pipeline for sample_count and win_type.
+		 *
+		 * Other sizes and windows get their own pipeline on first use, see prepare().
+		 */
+		static auto create(size_t sample_count , const WindowFunction::win_type win_type, const ProcessingOptions& options = {}) ->std::shared_ptr<ModuleSignalProcessing>;
+
+		/*!
+		 * \brief create() on a shared Runtime.
+		 *
+		 * The module only adds its own command queue, kernels, plans and buffers,
+		 * so one stream per channel does not pay for a context and a compile each.
+		 * Modules of one runtime may be driven from different threads.
+		 */
+		static auto create(const std::shared_ptr<Runtime>& runtime, size_t sample_count, const WindowFunction::win_type win_type, const ProcessingOptions& options = {}) ->std::shared_ptr<ModuleSignalProcessing>;
+
+		/*!
+		 * \brief Blocking round trip: submit() followed by wait().
+		 *
+		 * Frames that were submitted earlier and not collected yet are dropped.
+		 */
 		auto perform(const std::shared_ptr<AllignedBufferI16C>& rawData) ->std::shared_ptr<AllignedBufferF>;
 
+		/*!
+		 * \brief Enqueue upload, window, FFT, post-process and download of one frame
+		 * without waiting for any of it.
+		 *
+		 * The frame goes to the pipeline of rawData->size() and the current window.
+		 * rawData is kept alive until the frame is collected by wait(). The stages
+		 * of consecutive frames only overlap on the device with more than one
+		 * ProcessingOptions::queues. Returns false when in_flight submissions are
+		 * already pending (call wait() first) or when no pipeline can be built for
+		 * the frame size.
+		 */
+		auto submit(const std::shared_ptr<AllignedBufferI16C>& rawData) ->bool;
+
+		/*!
+		 * \brief Block until the oldest submitted frame is done and return its spectrum.
+		 *
+		 * Returns nullptr when nothing is pending.
+		 */
+		auto wait() ->std::shared_ptr<AllignedBufferF>;
+
+		/*!
+		 * \brief Pipelined perform(): submit rawData and, once every buffer set is
+		 * busy, collect the oldest finished frame into retBuffer first.
+		 *
+		 * retBuffer is nullptr while the pipeline is still filling; drain the
+		 * remaining frames with wait(). Returns the result of submit(), a frame
+		 * collected before a failed submit() is still handed out.
+		 */
+		auto performAsync(const std::shared_ptr<AllignedBufferI16C>& rawData, std::shared_ptr<AllignedBufferF>& retBuffer) ->bool;
+
+		/*!
+		 * \brief Blocking round trip of up to batch() frames in one transform.
+		 */
+		auto performBatch(const std::vector<std::shared_ptr<AllignedBufferI16C>>& frames) ->std::vector<std::shared_ptr<AllignedBufferF>>;
+
+		/*!
+		 * \brief submit() for 1..batch() frames of the same size sharing one upload,
+		 * window, FFT, post-process and download round.
+		 *
+		 * The clFFT plan always transforms batch() frames; when fewer are given
+		 * the remaining transforms run on stale data and are not downloaded.
+		 */
+		auto submitBatch(const std::vector<std::shared_ptr<AllignedBufferI16C>>& frames) ->bool;
+
+		/*!
+		 * \brief Append a contiguous block of samples to the stream and submit
+		 * the overlapping frames it completes.
+		 *
+		 * Each block is uploaded once into a device buffer that keeps the samples
+		 * the next frames still need; the window kernel reads every frame at its
+		 * hop offset from there, so a sample crosses the bus once whatever the
+		 * overlap. Frames have the create() size and the current window. Up to
+		 * batch() frames go into one submission, further complete frames stay on
+		 * the device for the next call. A block that completes no frame is still
+		 * a submission, its wait() returns nullptr. Runs on the first queue only
+		 * and not in averaging mode; the fused plans are not used.
+		 */
+		auto submitStream(const std::shared_ptr<AllignedBufferI16C>& block) ->bool;
+
+		//! Frame advance of submitStream(), 1 .. frame size, 0 for the frame size.
+		void setStreamHop(size_t hop) { stream_hop_ = hop; }
+		size_t streamHop() const { return stream_hop_; }
+
+		//! Drop the samples kept for the next frames, e.g. after a gap in the input.
+		void resetStream();
+
+		/*!
+		 * \brief wait() for a whole submission, one spectrum per submitted frame.
+		 *
+		 * wait() returns the first spectrum of the same submission.
+		 */
+		auto waitBatch() ->std::vector<std::shared_ptr<AllignedBufferF>>;
+
+		/*!
+		 * \brief waitBatch() returning every selected output stage.
+		 */
+		auto waitSpectra() ->std::vector<Spectrum>;
+
+		/*!
+		 * \brief Select the output_stage mask for the following submissions.
+		 *
+		 * Only the selected stages run on the device and only their buffers are
+		 * downloaded; the post-process kernel is skipped entirely when neither
+		 * OUTPUT_POWER nor OUTPUT_DB is selected. wait() and waitBatch() return
+		 * nullptr spectra unless OUTPUT_DB is selected.
+		 */
+		void setOutputs(unsigned outputs) { outputs_ = outputs; }
+		unsigned outputs() const { return outputs_; }
+
+		/*!
+		 * \brief Storage of the OUTPUT_DB spectrum of the following submissions.
+		 *
+		 * The 16 bit formats are written by the post-process kernel in the same
+		 * pass and halve the download; they are always copied, even in zero copy
+		 * mode, and the fused mode only produces FORMAT_FLOAT32. Averaged spectra
+		 * stay float. perform() and wait() return Spectrum::db, i.e. nullptr in
+		 * the 16 bit formats; use waitSpectra() there.
+		 */
+		void setDbFormat(output_format format) { db_format_ = format; }
+		output_format dbFormat() const { return db_format_; }
+
+		/*!
+		 * \brief Average frames on the device and download only the result.
+		 *
+		 * The power of every segment is added to an accumulator on the device;
+		 * every averaging.frames frames it is converted once into the selected
+		 * OUTPUT_POWER / OUTPUT_DB stages and downloaded. The submission that
+		 * completes an average returns it from wait(), the others return nullptr
+		 * (an empty vector from waitSpectra()). OUTPUT_COMPLEX, OUTPUT_DISPLAY,
+		 * OUTPUT_PEAKS, the packed dB formats and the fused mode do not apply.
+		 * Averaging runs on the first queue only, since every frame updates the
+		 * same accumulator. Any call restarts the averages.
+		 */
+		void setAveraging(const AveragingOptions& averaging);
+		const AveragingOptions& averaging() const { return averaging_; }
+
+		/*!
+		 * \brief Bucketing of the OUTPUT_DISPLAY stage.
+		 *
+		 * The dB spectrum is reduced on the device and only the buckets are
+		 * downloaded, bins floats per frame (twice that for DISPLAY_MIN_MAX, as
+		 * min / max pairs). Buckets split the span evenly; when there are more
+		 * buckets than bins, neighbouring buckets repeat a bin.
+		 */
+		void setDisplay(const DisplayOptions& display);
+		const DisplayOptions& display() const { return display_; }
+
+		/*!
+		 * \brief Peak search of the OUTPUT_PEAKS stage.
+		 *
+		 * A bin is a peak when it is above threshold_db, above its left and not
+		 * below its right neighbour in the dB spectrum; the first and last bin
+		 * never are. The strongest count of them are selected on the device and
+		 * only that list is downloaded. PEAK_QUINN is exact for an unwindowed
+		 * tone only, submissions with it and any other window are rejected.
+		 */
+		void setPeaks(const PeakOptions& peaks);
+		const PeakOptions& peaks() const { return peaks_; }
+
+		/*!
+		 * \brief Keep the selected trace_type traces on the device.
+		 *
+		 * The post-process kernel updates them in the same pass as the dB
+		 * conversion, so they cost no extra pass and no download per frame; with
+		 * an output mask of 0 nothing but the traces is computed. readTrace()
+		 * downloads one on demand. Traces are kept per frame size and window, the
+		 * fused mode and averaging do not update them. Any call resets them.
+		 */
+		void setTraces(unsigned traces);
+		unsigned traces() const { return traces_; }
+
+		//! Restart all traces with the next submitted frame.
+		void resetTraces();
+
+		void setPersistenceDecay(float db_per_frame) { persistence_decay_db_ = db_per_frame; }
+		float persistenceDecay() const { return persistence_decay_db_; }
+
+		/*!
+		 * \brief Download trace after every submission so far.
+		 *
+		 * Blocks until the last submission that updated it has run. Returns
+		 * nullptr when trace is not selected or no frame of sample_count and the
+		 * current window was submitted since the last reset. A sample_count of 0
+		 * selects the create() size.
+		 */
+		auto readTrace(trace_type trace, size_t sample_count = 0) ->std::shared_ptr<AllignedBufferF>;
+
+		/*!
+		 * \brief Window applied to the following submissions.
+		 *
+		 * Switching back and forth is free once both windows were used at a size.
+		 */
+		void setWindow(const WindowFunction::win_type win_type) { win_type_ = win_type; }
+		WindowFunction::win_type window() const { return win_type_; }
+
+		/*!
+		 * \brief Build plan, window and device buffers for sample_count and the
+		 * current window now instead of on the first submit() of that size.
+		 */
+		auto prepare(size_t sample_count) ->bool;
+
+		/*!
+		 * \brief Allocate a frame the device can read without a copy.
+		 *
+		 * In zero copy mode the samples live in CL_MEM_USE_HOST_PTR memory that
+		 * stays mapped while the host owns the frame; submit() unmaps it for the
+		 * window kernel instead of uploading it. Such a frame must not be written
+		 * or submitted again between submit() and the matching wait(), submit()
+		 * rejects the latter. In copy mode this is a plain
+		 * AllignedBufferI16C. A sample_count of 0 selects the create() size.
+		 */
+		auto allocateInput(size_t sample_count = 0) ->std::shared_ptr<AllignedBufferI16C>;
+
+		bool zeroCopy() const { return zero_copy_; }
+
+		/*!
+		 * \brief True when the pipeline of the create() size and the current window
+		 * baked its fused plans.
+		 *
+		 * A fused submission is a single clFFT transform: its pre-callback converts
+		 * int16 to float and applies the window while loading, its post-callback
+		 * scales, converts to dB and fftshifts while storing. It is used while the
+		 * output mask is exactly OUTPUT_DB; any other mask, or a device where the
+		 * callbacks fail to bake, runs the window / FFT / post-process kernels.
+		 */
+		bool fused() const;
+
+		const std::shared_ptr<Runtime>& runtime() const { return runtime_; }
+
+		/*!
+		 * \brief Timing of stage over the last profiling_window submissions.
+		 *
+		 * A submission is recorded when it is collected by wait(). Empty unless
+		 * the module was created with profiling enabled.
+		 */
+		auto profile(stage s) const ->StageProfile;
+		void resetProfile();
+		bool profiling() const { return profiler_ != nullptr; }
+
+		//! Device time of the submission last collected by wait(), first command start
+		//! to last command end. 0 unless the module was created with profiling enabled.
+		double lastDeviceSeconds() const { return last_device_seconds_; }
+
+		size_t vectorWidth() const { return vector_width_; }
+		//! True when the kernels run with -cl-fast-relaxed-math, i.e. the accuracy gate passed.
+		bool fastMath() const { return fast_math_; }
+
+		size_t pending() const { return submitted_.size(); }
+		size_t batch() const { return batch_; }
+
 	private:
-		cl_context context_;
-		cl_command_queue command_queue_;
-		cl_program program_;
-		cl_kernel kernel_preprocess_;
-		cl_kernel kernel_postprocess_;
-
-		cl_mem mem_obj_input_;
-		cl_mem mem_obj_window_;
-		cl_mem mem_obj_fft_;
-		cl_mem signal_power_out_;
-
-		clfftSetupData* fftSetup_;
-		clfftPlanHandle planHandle_;
+		struct HostMapping;
+		struct HostRegistry;
+
+		struct FrameSlot
+		{
+			cl_mem mem_obj_input_{ nullptr };
+			cl_mem mem_obj_fft_{ nullptr };
+			cl_mem signal_linear_out_{ nullptr };
+			cl_mem signal_power_out_{ nullptr };
+			cl_mem packed_out_{ nullptr };  // OUTPUT_DB in FORMAT_HALF or FORMAT_CENTI_DB
+			cl_mem display_out_{ nullptr }; // sized for the DisplayOptions it was created with
+
+			// OUTPUT_PEAKS: local maxima of every frame, their number and the selected Peak list
+			cl_mem peak_bins_{ nullptr };
+			cl_mem peak_db_{ nullptr };
+			cl_mem peak_counts_{ nullptr };
+			cl_mem peaks_out_{ nullptr }; // sized for the PeakOptions it was created with
+
+			// out-of-place plan whose post-callback writes into signal_power_out_
+			clfftPlanHandle fused_plan_{ 0 };
+
+			// clFFT scratch memory, only when the plans need any
+			cl_mem tmp_buffer_{ nullptr };
+
+			// Zero copy outputs, handed out again once the caller dropped the spectra of the last round
+			std::shared_ptr<HostMapping> power_mapping_;
+			std::shared_ptr<HostMapping> db_mapping_;
+
+			// allocateInput() frames the device owns until wait()
+			std::vector<std::shared_ptr<HostMapping>> input_mappings_;
+
+			std::vector<cl_event> upload_done_;
+			cl_event window_done_{ nullptr };
+			cl_event fft_done_{ nullptr };
+			cl_event postprocess_done_{ nullptr };
+			cl_event display_done_{ nullptr };
+			cl_event peaks_done_{ nullptr };
+			std::vector<cl_event> download_done_;
+
+			std::vector<std::shared_ptr<AllignedBufferI16C>> input_;
+			std::vector<Spectrum> result_;
+		};
+
+		//! Everything that depends on the frame size and the window.
+		struct Pipeline
+		{
+			size_t sample_count_{ 0 };
+			cl_mem mem_obj_window_{ nullptr };
+			clfftPlanHandle planHandle_{ 0 };
+			bool fused_{ false };
+
+			// kernels of the module this pipeline runs, vectorised when the size allows
+			cl_kernel preprocess_{ nullptr };
+			cl_kernel postprocess_{ nullptr };
+			size_t width_{ 1 };
+
+			// work-items of dimension 0 that carry data, the launch pads them to whole work-groups
+			int items_preprocess_{ 0 };
+			int items_postprocess_{ 0 };
+
+			// tuned local sizes of dimension 0, 0 lets the runtime choose
+			size_t local_preprocess_{ 0 };
+			size_t local_postprocess_{ 0 };
+
+			std::vector<FrameSlot> slots_;
+			size_t next_slot_{ 0 };
+			size_t in_flight_{ 0 };
+
+			// Welch averaging, built by prepareAveraging() on first use.
+			// welch_history_ holds the previous frame followed by the newest one.
+			cl_mem welch_history_{ nullptr };
+			cl_mem welch_segments_{ nullptr };
+			cl_mem welch_accumulator_{ nullptr };
+			clfftPlanHandle welch_plan_{ 0 };
+			size_t welch_segment_count_{ 0 };
+			bool welch_primed_{ false };  // history holds a previous frame
+			bool welch_reset_{ true };    // the next segment starts a new average
+			size_t welch_frames_{ 0 };    // frames since the last report
+			size_t welch_accumulated_{ 0 }; // segments in the accumulator, linear mode
+
+			// submitStream() input: the current buffer holds stream_valid_ samples, the next frame
+			// starts at stream_consumed_. A new block goes behind the rest in the other buffer.
+			cl_mem stream_buffers_[2]{ nullptr, nullptr };
+			size_t stream_capacity_[2]{ 0, 0 };
+			size_t stream_current_{ 0 };
+			size_t stream_valid_{ 0 };
+			size_t stream_consumed_{ 0 };
+
+			// max-hold, min-hold and persistence trace back to back, created on first use.
+			// Submissions on different queues update them in order through traces_done_.
+			cl_mem traces_{ nullptr };
+			cl_event traces_done_{ nullptr };
+			bool traces_reset_{ true };   // the next frame starts the traces over
+		};
+
+		static void releaseEvents(FrameSlot& slot);
+		auto mapHostMemory(size_t bytes, bool device_writes) ->std::shared_ptr<HostMapping>;
+		auto reuseHostMemory(std::shared_ptr<HostMapping>& pooled, size_t bytes, cl_command_queue queue, std::vector<cl_event>& unmapped) ->std::shared_ptr<HostMapping>;
+		auto ensureBuffer(cl_mem& mem, size_t bytes) ->bool;
+
+		auto findPipeline(size_t sample_count) ->Pipeline*;
+		auto buildPipeline(size_t sample_count, const WindowFunction::win_type win_type) ->std::unique_ptr<Pipeline>;
+		void releasePipeline(Pipeline& pipeline);
+		auto bakeFusedPlan(Pipeline& pipeline, FrameSlot& slot) ->bool;
+
+		auto prepareAveraging(Pipeline& pipeline) ->bool;
+		void releaseAveraging(Pipeline& pipeline);
+		auto submitAveraging(Pipeline& pipeline, FrameSlot& slot, const std::vector<std::shared_ptr<AllignedBufferI16C>>& frames) ->bool;
+
+		//! Frames already on the device, read by the window kernel stride samples apart.
+		struct StreamInput
+		{
+			cl_mem buffer_{ nullptr };
+			int stride_{ 0 };
+			size_t frame_count_{ 0 };
+			std::vector<cl_event> uploaded_;
+		};
+
+		//! Everything of submitBatch() and submitStream() after the checks.
+		auto submitFrames(Pipeline* pipeline, const std::vector<std::shared_ptr<AllignedBufferI16C>>& frames, StreamInput* stream) ->bool;
+
+		auto createKernels(bool fast_math) ->bool;
+		void releaseKernels();
+		auto checkAccuracy(float tolerance_db) ->bool;
+
+		std::shared_ptr<Runtime> runtime_;
+		cl_context context_{ nullptr };
+		cl_command_queue command_queue_{ nullptr };
+		std::vector<cl_command_queue> extra_queues_; // ProcessingOptions::queues beyond the first
+		size_t next_queue_{ 0 };
+		cl_kernel kernel_preprocess_{ nullptr };
+		cl_kernel kernel_postprocess_{ nullptr };
+		cl_kernel kernel_preprocess_vec_{ nullptr };
+		cl_kernel kernel_postprocess_vec_{ nullptr };
+		cl_kernel kernel_welch_segments_{ nullptr };
+		cl_kernel kernel_welch_accumulate_{ nullptr };
+		cl_kernel kernel_welch_output_{ nullptr };
+		cl_kernel kernel_display_{ nullptr };
+		cl_kernel kernel_peak_candidates_{ nullptr };
+		cl_kernel kernel_peak_topk_{ nullptr };
+		size_t peak_local_{ 1 }; // work-group size of the top-K selection, a power of two
+		size_t vector_width_{ 1 };
+		bool fast_math_{ false };
+
+		std::map<std::pair<size_t, WindowFunction::win_type>, std::unique_ptr<Pipeline>> pipelines_;
+		std::deque<Pipeline*> submitted_; // submission order across all pipelines
+		size_t sample_count_{ 0 };
+		WindowFunction::win_type win_type_{ WindowFunction::WIN_RECTANGULAR };
+		size_t max_in_flight_{ 1 };
+		size_t batch_{ 1 };
+		unsigned outputs_{ OUTPUT_DB };
+		output_format db_format_{ FORMAT_FLOAT32 };
+		size_t stream_hop_{ 0 };
+		AveragingOptions averaging_;
+		DisplayOptions display_;
+		PeakOptions peaks_;
+		unsigned traces_{ 0 };
+		float persistence_decay_db_{ 0.5f };
+		bool fused_requested_{ false };
+
+		bool zero_copy_{ false };
+		size_t host_alignment_{ 4096 };
+		std::shared_ptr<HostRegistry> host_registry_;
+
+		std::unique_ptr<StageProfiler> profiler_;
+		double last_device_seconds_{ 0.0 };
 
 	};
 
@@ -0,0 +1,249 @@
+#include "ProgramCache.h"
+
+#include <CL/cl.h>
+
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+
+#ifdef _WIN32
+#include <process.h>
+#else
+#include <unistd.h>
+#endif
+
+namespace ocl
+{
+	// <path>.<process id>.<counter>.tmp, two processes storing the same entry never share a temporary file
+	static auto tempPath(const std::string& path) ->std::string
+	{
+		static std::atomic<unsigned> counter{ 0 };
+#ifdef _WIN32
+		const int pid = _getpid();
+#else
+		const int pid = getpid();
+#endif
+		return path + "." + std::to_string(pid) + "." + std::to_string(counter++) + ".tmp";
+	}
+
+	static auto loadDeviceString(const cl_device_id dev, cl_device_info name)->std::string
+	{
+		std::size_t paramValueSize;
+		if (clGetDeviceInfo(dev, name, 0, nullptr, &paramValueSize) != CL_SUCCESS)
+		{
+			return "";
+		}
+
+		std::string info; info.resize(paramValueSize);
+		if (clGetDeviceInfo(dev, name, paramValueSize, &info[0], nullptr) != CL_SUCCESS)
+		{
+			return "";
+		}
+
+		return info;
+	}
+
+	// 64 bit FNV-1a, only used to name cache files; the full key is stored inside the entry
+	static auto hashFnv1a(const std::string& text) ->uint64_t
+	{
+		uint64_t hash = 14695981039346656037ull;
+		for (unsigned char c : text)
+		{
+			hash ^= c;
+			hash *= 1099511628211ull;
+		}
+		return hash;
+	}
+
+	ProgramCache::ProgramCache(const std::string& directory)
+		: directory_(directory.empty() ? defaultDirectory() : directory)
+	{
+	}
+
+	auto ProgramCache::defaultDirectory() ->std::string
+	{
+		std::error_code ec;
+		auto tmp = std::filesystem::temp_directory_path(ec);
+		if (ec)
+		{
+			return "OClTools_cache";
+		}
+
+		return (tmp / "OClTools" / "cache").string();
+	}
+
+	void ProgramCache::shareWithClfft() const
+	{
+		if (std::getenv("CLFFT_CACHE_PATH") != nullptr)
+		{
+			return;
+		}
+
+		std::error_code ec;
+		std::filesystem::create_directories(directory_, ec);
+
+#ifdef _WIN32
+		_putenv_s("CLFFT_CACHE_PATH", directory_.c_str());
+#else
+		setenv("CLFFT_CACHE_PATH", directory_.c_str(), 0);
+#endif
+	}
+
+	auto ProgramCache::makeKey(cl_device_id device, const std::vector<std::string>& sources, const std::string& options) const ->std::string
+	{
+		std::string source_text;
+		for (const auto& source : sources)
+		{
+			source_text += source;
+			source_text.push_back('\0');
+		}
+
+		std::string key;
+		key += loadDeviceString(device, CL_DEVICE_NAME).c_str(); key += "|";
+		key += loadDeviceString(device, CL_DEVICE_VERSION).c_str(); key += "|";
+		key += loadDeviceString(device, CL_DRIVER_VERSION).c_str(); key += "|";
+		key += options; key += "|";
+		key += std::to_string(hashFnv1a(source_text)); key += "|";
+		key += std::to_string(source_text.size());
+
+		return key;
+	}
+
+	auto ProgramCache::entryPath(const std::string& key) const ->std::string
+	{
+		char name[32];
+		snprintf(name, sizeof(name), "%016llx.clbin", (unsigned long long)hashFnv1a(key));
+
+		return (std::filesystem::path(directory_) / name).string();
+	}
+
+	auto ProgramCache::load(const std::string& key) const ->std::vector<unsigned char>
+	{
+		std::ifstream file(entryPath(key), std::ios::binary);
+		if (!file)
+		{
+			return {};
+		}
+
+		// [key length][key][binary], a different key in the same file is a hash collision
+		uint64_t key_size = 0;
+		file.read((char*)&key_size, sizeof(key_size));
+		if (!file || key_size != key.size())
+		{
+			return {};
+		}
+
+		std::string stored_key; stored_key.resize(key_size);
+		file.read(&stored_key[0], std::streamsize(key_size));
+		if (!file || stored_key != key)
+		{
+			return {};
+		}
+
+		std::vector<unsigned char> binary((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+		return binary;
+	}
+
+	void ProgramCache::store(const std::string& key, const std::vector<unsigned char>& binary) const
+	{
+		std::error_code ec;
+		std::filesystem::create_directories(directory_, ec);
+
+		// Write aside and rename, so a concurrent process never reads half an entry
+		const std::string path = entryPath(key);
+		const std::string tmp_path = tempPath(path);
+		{
+			std::ofstream file(tmp_path, std::ios::binary | std::ios::trunc);
+			if (!file)
+			{
+				return;
+			}
+
+			uint64_t key_size = key.size();
+			file.write((const char*)&key_size, sizeof(key_size));
+			file.write(key.data(), std::streamsize(key.size()));
+			file.write((const char*)binary.data(), std::streamsize(binary.size()));
+			if (!file)
+			{
+				file.close();
+				std::filesystem::remove(tmp_path, ec);
+				return;
+			}
+		}
+
+		std::filesystem::rename(tmp_path, path, ec);
+		if (ec)
+		{
+			std::filesystem::remove(tmp_path, ec);
+		}
+	}
+
+	auto ProgramCache::build(cl_context context, cl_device_id device, const std::vector<std::string>& sources, const std::string& options) ->cl_program
+	{
+		cl_int ret;
+		const std::string key = makeKey(device, sources, options);
+
+		auto binary = load(key);
+		if (!binary.empty())
+		{
+			const unsigned char* binary_ptr = binary.data();
+			size_t binary_size = binary.size();
+			cl_int binary_status;
+
+			cl_program program = clCreateProgramWithBinary(context, 1, &device, &binary_size, &binary_ptr, &binary_status, &ret);
+			if (ret == CL_SUCCESS && binary_status == CL_SUCCESS)
+			{
+				ret = clBuildProgram(program, 1, &device, options.c_str(), NULL, NULL);
+				if (ret == CL_SUCCESS)
+				{
+					return program;
+				}
+			}
+
+			// Stale or rejected entry, rebuild from source and overwrite it
+			if (program != nullptr)
+			{
+				clReleaseProgram(program);
+			}
+		}
+
+		std::vector<const char*> source_str;
+		std::vector<size_t> source_size;
+		for (const auto& source : sources)
+		{
+			source_str.push_back(source.data());
+			source_size.push_back(source.size());
+		}
+
+		cl_program program = clCreateProgramWithSource(context, cl_uint(sources.size()), source_str.data(), source_size.data(), &ret);
+		if (ret != CL_SUCCESS)
+		{
+			return nullptr;
+		}
+
+		ret = clBuildProgram(program, 1, &device, options.c_str(), NULL, NULL);
+		if (ret != CL_SUCCESS)
+		{
+			clReleaseProgram(program);
+			return nullptr;
+		}
+
+		size_t binary_size = 0;
+		ret = clGetProgramInfo(program, CL_PROGRAM_BINARY_SIZES, sizeof(size_t), &binary_size, NULL);
+		if (ret == CL_SUCCESS && binary_size > 0)
+		{
+			binary.resize(binary_size);
+			unsigned char* binary_ptr = binary.data();
+			ret = clGetProgramInfo(program, CL_PROGRAM_BINARIES, sizeof(unsigned char*), &binary_ptr, NULL);
+			if (ret == CL_SUCCESS)
+			{
+				store(key, binary);
+			}
+		}
+
+		return program;
+	}
+}
@@ -0,0 +1,56 @@
+#pragma once
+#include <cstdint>
+#include <string>
+#include <vector>
+
+typedef struct _cl_context* cl_context;
+typedef struct _cl_device_id* cl_device_id;
+typedef struct _cl_program* cl_program;
+
+namespace ocl
+{
+	/*!
+	 * \brief On-disk cache of compiled OpenCL programs.
+	 *
+	 * Entries are keyed by device name, device and driver version, build options
+	 * and a hash of the kernel sources, so a driver update or a kernel change
+	 * simply misses and rebuilds from source.
+	 */
+	class ProgramCache
+	{
+	public:
+		//! An empty directory selects defaultDirectory().
+		ProgramCache(const std::string& directory);
+		~ProgramCache() = default;
+
+		//! <temp>/OClTools/cache
+		static auto defaultDirectory()->std::string;
+
+		/*!
+		 * \brief Build sources for device, reusing the cached binary when possible.
+		 *
+		 * A freshly compiled program is written back to the cache. Returns nullptr
+		 * when the program does not build.
+		 */
+		auto build(cl_context context, cl_device_id device, const std::vector<std::string>& sources, const std::string& options) ->cl_program;
+
+		/*!
+		 * \brief Let clFFT cache its baked plan kernels in the same directory.
+		 *
+		 * clFFT stores and reloads plan binaries on its own when CLFFT_CACHE_PATH is
+		 * set; an existing value is left alone. Must run before clfftSetup().
+		 */
+		void shareWithClfft() const;
+
+		const std::string& directory() const { return directory_; }
+
+	private:
+		auto makeKey(cl_device_id device, const std::vector<std::string>& sources, const std::string& options) const ->std::string;
+		auto entryPath(const std::string& key) const ->std::string;
+
+		auto load(const std::string& key) const ->std::vector<unsigned char>;
+		void store(const std::string& key, const std::vector<unsigned char>& binary) const;
+
+		std::string directory_;
+	};
+}
@@ -0,0 +1,192 @@
+#include "Runtime.h"
+#include "ProgramCache.h"
+#include "WorkGroupTuner.h"
+
+#define CL_HPP_MINIMUM_OPENCL_VERSION 120
+#define CL_HPP_TARGET_OPENCL_VERSION 120
+
+#include <CL/cl2.hpp>
+#include <clFFT.h>
+
+namespace ocl
+{
+	// clFFT keeps one global state per process, shared by every Runtime
+	static std::mutex clfft_mutex;
+	static size_t clfft_users = 0;
+	static clfftSetupData* clfft_setup = nullptr;
+
+	static auto acquireClfft() ->bool
+	{
+		std::lock_guard<std::mutex> lock(clfft_mutex);
+		if (clfft_users == 0)
+		{
+			clfft_setup = new clfftSetupData;
+			clfftInitSetupData(clfft_setup);
+			if (clfftSetup(clfft_setup) != CLFFT_SUCCESS)
+			{
+				delete clfft_setup;
+				clfft_setup = nullptr;
+				return false;
+			}
+		}
+		++clfft_users;
+
+		return true;
+	}
+
+	static void releaseClfft()
+	{
+		std::lock_guard<std::mutex> lock(clfft_mutex);
+		if (--clfft_users == 0)
+		{
+			clfftTeardown();
+			delete clfft_setup;
+			clfft_setup = nullptr;
+		}
+	}
+
+	Runtime::~Runtime()
+	{
+		for (auto& entry : programs_)
+		{
+			clReleaseProgram(entry.second);
+		}
+
+		if (clfft_setup_) releaseClfft();
+		if (context_ != nullptr) clReleaseContext(context_);
+	}
+
+	auto Runtime::create(const RuntimeOptions& options) ->std::shared_ptr<Runtime>
+	{
+		// Filter for a 2.0 platform and set it as the default
+		std::vector<cl::Platform> platforms;
+		cl::Platform::get(&platforms);
+		cl::Platform plat;
+
+		for (auto& p : platforms)
+		{
+			std::string pl_vendor = p.getInfo<CL_PLATFORM_VENDOR>();
+
+			if (pl_vendor.find("NVIDIA ") != std::string::npos)
+			{
+				plat = p;
+				break;
+			}
+
+			if (pl_vendor.find("AND") != std::string::npos)
+			{
+				plat = p;
+				break;
+			}
+
+			if (pl_vendor.find("Intel") != std::string::npos)
+			{
+				plat = p;
+				break;
+			}
+		}
+
+		std::vector<cl::Device> device;
+		plat.getDevices(CL_DEVICE_TYPE_GPU, &device);
+
+		if (device.empty())
+		{
+			plat.getDevices(CL_DEVICE_TYPE_CPU, &device);
+		}
+		if (device.size() == 0)
+		{
+			return {};
+		}
+
+		return create(device[0].get(), options);
+	}
+
+	auto Runtime::create(cl_device_id device, const RuntimeOptions& options) ->std::shared_ptr<Runtime>
+	{
+		if (device == nullptr)
+		{
+			return {};
+		}
+
+		cl_int ret;
+
+		// Everything created below is owned by obj, so an early return releases it in the destructor.
+		std::shared_ptr<Runtime> obj = std::shared_ptr<Runtime>(new Runtime);
+		obj->device_ = device;
+		obj->program_cache_ = options.program_cache;
+		obj->cache_directory_ = options.cache_directory.empty() ? ProgramCache::defaultDirectory() : options.cache_directory;
+		obj->tuner_ = std::make_unique<WorkGroupTuner>(options.program_cache ? obj->cache_directory_ : "");
+
+		// Create an OpenCL context
+		obj->context_ = clCreateContext(NULL, 1, &obj->device_, NULL, NULL, &ret);
+		if (ret != CL_SUCCESS)
+		{
+			obj->context_ = nullptr;
+			return {};
+		}
+
+		/* Setup clFFT. */
+		if (options.program_cache)
+		{
+			ProgramCache(obj->cache_directory_).shareWithClfft();
+		}
+		obj->clfft_setup_ = acquireClfft();
+		if (!obj->clfft_setup_)
+		{
+			return {};
+		}
+
+		return obj;
+	}
+
+	auto Runtime::program(const std::vector<std::string>& sources, const std::string& options) ->cl_program
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+
+		auto key = std::make_pair(sources, options);
+		auto it = programs_.find(key);
+		if (it != programs_.end())
+		{
+			return it->second;
+		}
+
+		cl_program program = nullptr;
+		if (program_cache_)
+		{
+			// Or from the binary an earlier run left in the cache
+			program = ProgramCache(cache_directory_).build(context_, device_, sources, options);
+		}
+		else
+		{
+			cl_int ret;
+			std::vector<const char*> source_str;
+			std::vector<size_t> source_size;
+			for (const auto& source : sources)
+			{
+				source_str.push_back(source.data());
+				source_size.push_back(source.size());
+			}
+
+			program = clCreateProgramWithSource(context_, cl_uint(sources.size()), source_str.data(), source_size.data(), &ret);
+			if (ret != CL_SUCCESS)
+			{
+				return nullptr;
+			}
+			// Build the program
+			ret = clBuildProgram(program, 1, &device_, options.c_str(), NULL, NULL);
+			if (ret != CL_SUCCESS)
+			{
+				clReleaseProgram(program);
+				return nullptr;
+			}
+		}
+		if (program == nullptr)
+		{
+			return nullptr;
+		}
+
+		programs_[key] = program;
+
+		return program;
+	}
+}
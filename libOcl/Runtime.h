@@ -0,0 +1,81 @@
+#pragma once
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+typedef struct _cl_context* cl_context;
+typedef struct _cl_device_id* cl_device_id;
+typedef struct _cl_program* cl_program;
+
+typedef struct clfftSetupData_ clfftSetupData;
+
+namespace ocl
+{
+	class WorkGroupTuner;
+
+	/*!
+	 * \brief Creation time settings of Runtime.
+	 */
+	struct RuntimeOptions
+	{
+		//! Reuse compiled kernels and clFFT plan binaries across processes, see ProgramCache.
+		bool program_cache = true;
+
+		//! Empty selects ProgramCache::defaultDirectory().
+		std::string cache_directory;
+	};
+
+	/*!
+	 * \brief Device, context, compiled programs and the clFFT library shared by
+	 * any number of ModuleSignalProcessing streams.
+	 *
+	 * clfftSetup() and clfftTeardown() are global library state; they are
+	 * reference counted across every Runtime of the process. Modules keep their
+	 * Runtime alive, so the last one to go tears clFFT down after its plans.
+	 */
+	class Runtime
+	{
+		Runtime() = default;
+	public:
+		~Runtime();
+
+		//! Pick the first NVIDIA, AMD or Intel platform, preferring a GPU over a CPU device.
+		static auto create(const RuntimeOptions& options = {}) ->std::shared_ptr<Runtime>;
+
+		//! Runtime on a given device, e.g. one of PlatformDeviceEnum::enumPlatform().
+		static auto create(cl_device_id device, const RuntimeOptions& options = {}) ->std::shared_ptr<Runtime>;
+
+		/*!
+		 * \brief Program built from sources with options, compiled once per runtime.
+		 *
+		 * The program stays owned by the runtime. Returns nullptr when it does not
+		 * build. Safe to call from several threads.
+		 */
+		auto program(const std::vector<std::string>& sources, const std::string& options = "") ->cl_program;
+
+		//! Local sizes of the kernels, persisted next to the program cache.
+		WorkGroupTuner& tuner() { return *tuner_; }
+
+		cl_context context() const { return context_; }
+		cl_device_id device() const { return device_; }
+		const std::string& cacheDirectory() const { return cache_directory_; }
+		bool programCache() const { return program_cache_; }
+
+	private:
+		cl_context context_{ nullptr };
+		cl_device_id device_{ nullptr };
+
+		bool program_cache_{ true };
+		std::string cache_directory_;
+
+		std::mutex mutex_;
+		std::map<std::pair<std::vector<std::string>, std::string>, cl_program> programs_;
+
+		std::unique_ptr<WorkGroupTuner> tuner_;
+
+		bool clfft_setup_{ false };
+	};
+}
@@ -0,0 +1,161 @@
+#include "StageProfiler.h"
+
+#include <CL/cl.h>
+
+#include <algorithm>
+#include <numeric>
+
+namespace ocl
+{
+	StageProfiler::StageProfiler(size_t window)
+		: window_(std::max<size_t>(window, 1))
+	{
+	}
+
+	void StageProfiler::record(stage s, const cl_event* events, size_t count, const cl_event* after, size_t after_count)
+	{
+		cl_ulong queued = ~cl_ulong(0);
+		cl_ulong submit = ~cl_ulong(0);
+		cl_ulong start = ~cl_ulong(0);
+		cl_ulong end = 0;
+
+		for (size_t index = 0; index < count; ++index)
+		{
+			cl_ulong times[4];
+			const cl_profiling_info names[4] = { CL_PROFILING_COMMAND_QUEUED, CL_PROFILING_COMMAND_SUBMIT, CL_PROFILING_COMMAND_START, CL_PROFILING_COMMAND_END };
+			for (int name = 0; name < 4; ++name)
+			{
+				if (clGetEventProfilingInfo(events[index], names[name], sizeof(cl_ulong), &times[name], NULL) != CL_SUCCESS)
+				{
+					return;
+				}
+			}
+
+			queued = std::min(queued, times[0]);
+			submit = std::min(submit, times[1]);
+			start = std::min(start, times[2]);
+			end = std::max(end, times[3]);
+		}
+
+		if (after_count > 0)
+		{
+			cl_ulong ready = 0;
+			for (size_t index = 0; index < after_count; ++index)
+			{
+				cl_ulong time;
+				if (clGetEventProfilingInfo(after[index], CL_PROFILING_COMMAND_END, sizeof(cl_ulong), &time, NULL) != CL_SUCCESS)
+				{
+					return;
+				}
+				ready = std::max(ready, time);
+			}
+
+			// The unprofiled commands were queued with the profiled ones, but ran from ready on
+			start = std::min(start, ready);
+			submit = std::min(submit, start);
+			queued = std::min(queued, submit);
+		}
+
+		if (count == 0 || end < start || start < submit || submit < queued)
+		{
+			return;
+		}
+
+		std::lock_guard<std::mutex> lock(mutex_);
+
+		auto& samples = stages_[s];
+		const double values[3] = { (submit - queued) * 1e-3, (start - submit) * 1e-3, (end - start) * 1e-3 };
+		std::vector<double>* targets[3] = { &samples.queued_, &samples.waiting_, &samples.running_ };
+		for (int index = 0; index < 3; ++index)
+		{
+			auto& target = *targets[index];
+			if (target.size() < window_)
+			{
+				target.push_back(values[index]);
+			}
+			else
+			{
+				target[samples.next_] = values[index];
+			}
+		}
+		if (samples.running_.size() == window_)
+		{
+			samples.next_ = (samples.next_ + 1) % window_;
+		}
+	}
+
+	auto StageProfiler::busySeconds(const std::vector<cl_event>& events) ->double
+	{
+		cl_ulong start = ~cl_ulong(0);
+		cl_ulong end = 0;
+		for (auto ev : events)
+		{
+			cl_ulong times[2];
+			if (clGetEventProfilingInfo(ev, CL_PROFILING_COMMAND_START, sizeof(cl_ulong), &times[0], NULL) != CL_SUCCESS
+				|| clGetEventProfilingInfo(ev, CL_PROFILING_COMMAND_END, sizeof(cl_ulong), &times[1], NULL) != CL_SUCCESS)
+			{
+				return 0.0;
+			}
+
+			start = std::min(start, times[0]);
+			end = std::max(end, times[1]);
+		}
+
+		if (events.empty() || end < start)
+		{
+			return 0.0;
+		}
+
+		return (end - start) * 1e-9;
+	}
+
+	auto StageProfiler::statistics(std::vector<double> durations) ->LatencyStatistics
+	{
+		LatencyStatistics stats;
+		if (durations.empty())
+		{
+			return stats;
+		}
+
+		std::sort(durations.begin(), durations.end());
+
+		// Nearest rank percentiles
+		auto percentile = [&](double p)
+		{
+			size_t rank = size_t(p * durations.size() + 0.999999);
+			return durations[std::min(std::max<size_t>(rank, 1), durations.size()) - 1];
+		};
+
+		stats.samples = durations.size();
+		stats.min_us = durations.front();
+		stats.mean_us = std::accumulate(durations.begin(), durations.end(), 0.0) / durations.size();
+		stats.p50_us = percentile(0.50);
+		stats.p99_us = percentile(0.99);
+
+		return stats;
+	}
+
+	auto StageProfiler::profile(stage s) const ->StageProfile
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+
+		const auto& samples = stages_[s];
+
+		StageProfile profile;
+		profile.queued = statistics(samples.queued_);
+		profile.waiting = statistics(samples.waiting_);
+		profile.running = statistics(samples.running_);
+
+		return profile;
+	}
+
+	void StageProfiler::reset()
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+
+		for (auto& samples : stages_)
+		{
+			samples = Samples{};
+		}
+	}
+}
@@ -0,0 +1,87 @@
+#pragma once
+#include <array>
+#include <mutex>
+#include <vector>
+
+typedef struct _cl_event* cl_event;
+
+namespace ocl
+{
+	/*!
+	 * \brief Device side steps of one ModuleSignalProcessing submission.
+	 */
+	enum stage {
+		STAGE_UPLOAD = 0,      //!< host to device copies, or unmapping zero copy frames
+		STAGE_WINDOW = 1,      //!< window kernel, absent in fused submissions
+		STAGE_FFT = 2,         //!< clFFT transform, every pass of a multi-pass plan
+		STAGE_POSTPROCESS = 3, //!< power / dB kernel
+		STAGE_DOWNLOAD = 4,    //!< device to host copies and maps
+		STAGE_COUNT = 5,
+	};
+
+	/*!
+	 * \brief min/mean/p50/p99 of a set of durations, in microseconds.
+	 */
+	struct LatencyStatistics
+	{
+		size_t samples = 0;
+		double min_us = 0.0;
+		double mean_us = 0.0;
+		double p50_us = 0.0;
+		double p99_us = 0.0;
+	};
+
+	/*!
+	 * \brief Timing of one stage over the last submissions.
+	 */
+	struct StageProfile
+	{
+		LatencyStatistics queued;  //!< CL_PROFILING_COMMAND_QUEUED to CL_PROFILING_COMMAND_SUBMIT
+		LatencyStatistics waiting; //!< CL_PROFILING_COMMAND_SUBMIT to CL_PROFILING_COMMAND_START
+		LatencyStatistics running; //!< CL_PROFILING_COMMAND_START to CL_PROFILING_COMMAND_END
+	};
+
+	/*!
+	 * \brief Rolling per-stage statistics of profiled OpenCL events.
+	 *
+	 * Needs a queue created with CL_QUEUE_PROFILING_ENABLE. Only the last
+	 * window submissions of every stage are kept.
+	 */
+	class StageProfiler
+	{
+	public:
+		StageProfiler(size_t window);
+		~StageProfiler() = default;
+
+		/*!
+		 * \brief Add one submission of stage, spanning every event in events.
+		 *
+		 * The events must be complete. Commands of one stage are merged from the
+		 * earliest queued to the latest end time. When the stage has commands
+		 * without an event, e.g. the earlier passes of a clFFT plan, after holds
+		 * the commands before them and the stage starts where the last one ended.
+		 */
+		void record(stage s, const cl_event* events, size_t count, const cl_event* after = nullptr, size_t after_count = 0);
+
+		auto profile(stage s) const ->StageProfile;
+		void reset();
+
+		//! Seconds from the earliest start to the latest end of the complete events, 0 when unprofiled.
+		static auto busySeconds(const std::vector<cl_event>& events) ->double;
+
+	private:
+		struct Samples
+		{
+			std::vector<double> queued_;
+			std::vector<double> waiting_;
+			std::vector<double> running_;
+			size_t next_{ 0 }; // oldest entry once the window is full
+		};
+
+		static auto statistics(std::vector<double> durations) ->LatencyStatistics;
+
+		size_t window_;
+		mutable std::mutex mutex_;
+		std::array<Samples, STAGE_COUNT> stages_;
+	};
+}
@@ -0,0 +1,259 @@
+#include "WorkGroupTuner.h"
+
+#include <CL/cl.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <vector>
+
+#ifdef _WIN32
+#include <process.h>
+#else
+#include <unistd.h>
+#endif
+
+namespace ocl
+{
+	// Timed launches per candidate, after one untimed warm-up launch
+	static const int tune_runs = 5;
+
+	// Unique per process and call, see ProgramCache
+	static auto tempPath(const std::string& path) ->std::string
+	{
+		static std::atomic<unsigned> counter{ 0 };
+#ifdef _WIN32
+		const int pid = _getpid();
+#else
+		const int pid = getpid();
+#endif
+		return path + "." + std::to_string(pid) + "." + std::to_string(counter++) + ".tmp";
+	}
+
+	static auto loadDeviceString(const cl_device_id dev, cl_device_info name)->std::string
+	{
+		std::size_t paramValueSize;
+		if (clGetDeviceInfo(dev, name, 0, nullptr, &paramValueSize) != CL_SUCCESS)
+		{
+			return "";
+		}
+
+		std::string info; info.resize(paramValueSize);
+		if (clGetDeviceInfo(dev, name, paramValueSize, &info[0], nullptr) != CL_SUCCESS)
+		{
+			return "";
+		}
+
+		return info;
+	}
+
+	static auto loadKernelName(const cl_kernel kernel)->std::string
+	{
+		std::size_t paramValueSize;
+		if (clGetKernelInfo(kernel, CL_KERNEL_FUNCTION_NAME, 0, nullptr, &paramValueSize) != CL_SUCCESS)
+		{
+			return "";
+		}
+
+		std::string info; info.resize(paramValueSize);
+		if (clGetKernelInfo(kernel, CL_KERNEL_FUNCTION_NAME, paramValueSize, &info[0], nullptr) != CL_SUCCESS)
+		{
+			return "";
+		}
+
+		return info;
+	}
+
+	// Options the program of kernel was built with, e.g. -cl-fast-relaxed-math
+	static auto loadBuildOptions(const cl_kernel kernel, const cl_device_id dev)->std::string
+	{
+		cl_program program = nullptr;
+		if (clGetKernelInfo(kernel, CL_KERNEL_PROGRAM, sizeof(cl_program), &program, nullptr) != CL_SUCCESS)
+		{
+			return "";
+		}
+
+		std::size_t paramValueSize;
+		if (clGetProgramBuildInfo(program, dev, CL_PROGRAM_BUILD_OPTIONS, 0, nullptr, &paramValueSize) != CL_SUCCESS)
+		{
+			return "";
+		}
+
+		std::string info; info.resize(paramValueSize);
+		if (clGetProgramBuildInfo(program, dev, CL_PROGRAM_BUILD_OPTIONS, paramValueSize, &info[0], nullptr) != CL_SUCCESS)
+		{
+			return "";
+		}
+
+		return info;
+	}
+
+	// Seconds per launch, or a negative value when the launch fails
+	static auto timeLaunch(cl_command_queue queue, cl_kernel kernel, const size_t items[2], size_t local) ->double
+	{
+		// Dimension 0 is padded to whole work-groups, the kernels skip the excess items
+		size_t global_size[] = { local != 0 ? (items[0] + local - 1) / local * local : items[0], items[1] };
+		size_t local_item_size[] = { local, 1 };
+		const size_t* local_ptr = local != 0 ? local_item_size : NULL;
+
+		if (clEnqueueNDRangeKernel(queue, kernel, 2, NULL, global_size, local_ptr, 0, NULL, NULL) != CL_SUCCESS || clFinish(queue) != CL_SUCCESS)
+		{
+			return -1.0;
+		}
+
+		auto start = std::chrono::steady_clock::now();
+		for (int run = 0; run < tune_runs; ++run)
+		{
+			if (clEnqueueNDRangeKernel(queue, kernel, 2, NULL, global_size, local_ptr, 0, NULL, NULL) != CL_SUCCESS)
+			{
+				clFinish(queue);
+				return -1.0;
+			}
+		}
+		if (clFinish(queue) != CL_SUCCESS)
+		{
+			return -1.0;
+		}
+
+		return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() / tune_runs;
+	}
+
+	WorkGroupTuner::WorkGroupTuner(const std::string& directory)
+	{
+		if (!directory.empty())
+		{
+			path_ = (std::filesystem::path(directory) / "workgroups.txt").string();
+			load();
+		}
+	}
+
+	void WorkGroupTuner::load()
+	{
+		std::ifstream file(path_);
+		std::string line;
+		while (std::getline(file, line))
+		{
+			// <key>\t<local size>
+			const auto tab = line.rfind('\t');
+			if (tab == std::string::npos)
+			{
+				continue;
+			}
+			results_[line.substr(0, tab)] = std::strtoull(line.c_str() + tab + 1, nullptr, 10);
+		}
+	}
+
+	void WorkGroupTuner::store() const
+	{
+		if (path_.empty())
+		{
+			return;
+		}
+
+		std::error_code ec;
+		std::filesystem::create_directories(std::filesystem::path(path_).parent_path(), ec);
+
+		// Write aside and rename, so a concurrent process never reads half a file
+		const std::string tmp_path = tempPath(path_);
+		{
+			std::ofstream file(tmp_path, std::ios::trunc);
+			if (!file)
+			{
+				return;
+			}
+			for (const auto& entry : results_)
+			{
+				file << entry.first << '\t' << entry.second << '\n';
+			}
+			if (!file)
+			{
+				file.close();
+				std::filesystem::remove(tmp_path, ec);
+				return;
+			}
+		}
+
+		std::filesystem::rename(tmp_path, path_, ec);
+		if (ec)
+		{
+			std::filesystem::remove(tmp_path, ec);
+		}
+	}
+
+	auto WorkGroupTuner::tune(cl_command_queue queue, cl_kernel kernel, const size_t items[2]) ->size_t
+	{
+		cl_device_id device = nullptr;
+		if (clGetCommandQueueInfo(queue, CL_QUEUE_DEVICE, sizeof(cl_device_id), &device, NULL) != CL_SUCCESS)
+		{
+			return 0;
+		}
+
+		// Tabs and line breaks would break the file format
+		std::string key;
+		key += loadDeviceString(device, CL_DEVICE_NAME).c_str(); key += "|";
+		key += loadDeviceString(device, CL_DRIVER_VERSION).c_str(); key += "|";
+		key += loadKernelName(kernel).c_str(); key += "|";
+		key += loadBuildOptions(kernel, device).c_str(); key += "|";
+		key += std::to_string(items[0]); key += "|";
+		key += std::to_string(items[1]);
+		std::replace_if(key.begin(), key.end(), [](char c) { return c == '\t' || c == '\n' || c == '\r'; }, ' ');
+
+		std::lock_guard<std::mutex> lock(mutex_);
+
+		auto it = results_.find(key);
+		if (it != results_.end())
+		{
+			return it->second;
+		}
+
+		size_t multiple = 1;
+		size_t kernel_max = 0;
+		size_t device_max = 0;
+		size_t item_max[3] = { 0, 0, 0 };
+		clGetKernelWorkGroupInfo(kernel, device, CL_KERNEL_PREFERRED_WORK_GROUP_SIZE_MULTIPLE, sizeof(size_t), &multiple, NULL);
+		clGetKernelWorkGroupInfo(kernel, device, CL_KERNEL_WORK_GROUP_SIZE, sizeof(size_t), &kernel_max, NULL);
+		clGetDeviceInfo(device, CL_DEVICE_MAX_WORK_GROUP_SIZE, sizeof(size_t), &device_max, NULL);
+		clGetDeviceInfo(device, CL_DEVICE_MAX_WORK_ITEM_SIZES, sizeof(item_max), item_max, NULL);
+
+		size_t limit = device_max;
+		if (kernel_max != 0) limit = std::min(limit, kernel_max);
+		if (item_max[0] != 0) limit = std::min(limit, item_max[0]);
+		multiple = std::max<size_t>(multiple, 1);
+
+		// Padding more than a whole group only adds idle work-items
+		std::vector<size_t> candidates = { 0 };
+		for (size_t local = multiple; local <= limit && local < 2 * items[0]; local *= 2)
+		{
+			candidates.push_back(local);
+		}
+
+		size_t best = 0;
+		double best_time = -1.0;
+		if (candidates.size() > 1)
+		{
+			for (size_t local : candidates)
+			{
+				const double time = timeLaunch(queue, kernel, items, local);
+				if (time >= 0.0 && (best_time < 0.0 || time < best_time))
+				{
+					best = local;
+					best_time = time;
+				}
+			}
+
+			// Nothing ran, try again next time instead of remembering a failure
+			if (best_time < 0.0)
+			{
+				return 0;
+			}
+		}
+
+		results_[key] = best;
+		store();
+
+		return best;
+	}
+}
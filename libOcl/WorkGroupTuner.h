@@ -0,0 +1,40 @@
+#pragma once
+#include <map>
+#include <mutex>
+#include <string>
+
+typedef struct _cl_command_queue* cl_command_queue;
+typedef struct _cl_kernel* cl_kernel;
+
+namespace ocl
+{
+	/*!
+	 * \brief Picks the fastest local work size of a kernel by running it.
+	 *
+	 * Results are kept per device, kernel, build options and launch size, and on
+	 * disk when a cache directory is given.
+	 */
+	class WorkGroupTuner
+	{
+	public:
+		//! An empty directory keeps the results in memory only.
+		WorkGroupTuner(const std::string& directory);
+		~WorkGroupTuner() = default;
+
+		/*!
+		 * \brief Local size of dimension 0 for a 2D launch over items, 0 for a NULL local size.
+		 *
+		 * Launches the kernel with its current arguments; padded work-items must return early.
+		 * Safe to call from several threads.
+		 */
+		auto tune(cl_command_queue queue, cl_kernel kernel, const size_t items[2]) ->size_t;
+
+	private:
+		void load();
+		void store() const;
+
+		std::string path_;
+		std::mutex mutex_;
+		std::map<std::string, size_t> results_;
+	};
+}